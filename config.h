@@ -2,13 +2,21 @@
 #define CONFIG_H
 
 #ifndef HANDY_VERSION
-#define HANDY_VERSION 1.1
+#define HANDY_VERSION 1.2
 #endif
 
 #ifndef HANDY_PASSWORD_MAX
 #define HANDY_PASSWORD_MAX 64
 #endif
 
+#ifndef HANDY_KDF_ITERATIONS
+#define HANDY_KDF_ITERATIONS 100000
+#endif
+
+#ifndef HANDY_THREADS_MAX
+#define HANDY_THREADS_MAX 256
+#endif
+
 #define STR(a) XSTR(a)
 #define XSTR(a) #a
 
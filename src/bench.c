@@ -0,0 +1,363 @@
+/* Measure the throughput of the cipher, stage by stage and on streams.
+ * Its correctness is checked by handy-check (make check). The cipher source
+ * is included to reach its internal functions.
+ *
+ * usage: handy-bench [-n <size>] [-a <alphabet>] [-t <threads>]
+ */
+
+#include "cipher.c"
+
+#include <time.h>
+
+#define OPTPARSE_IMPLEMENTATION
+#define OPTPARSE_API static
+#include "optparse.h"
+
+#define HARNESS_NAME "handy-bench"
+#include "harness.h"
+
+/* Default plaintext size and alphabet (spaces are ignored by the cipher). */
+#define BENCH_SIZE      (4*1024*1024)
+#define BENCH_ALPHABET  "ABCDEFGHIJKLMNOPQRSTUVWXYZ.,?-^     "
+
+/* Seed of the cipher, so that runs do the same work. */
+#define BENCH_SEED  42
+
+/* Return a time in seconds. */
+static double
+now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/* Print a result line: BYTES processed in SECONDS for N characters, and
+ * the expansion RATIO if not 0. */
+static void
+report(const char *stage, const char *mode, double seconds, size_t bytes,
+       size_t n, double ratio)
+{
+    printf("%-10s %-7s %9.1f MB/s %9.1f ns/char", stage, mode,
+           bytes / seconds / 1e6, seconds * 1e9 / (n ? n : 1));
+    if (ratio)
+        printf(" %6.2fx", ratio);
+    putchar('\n');
+}
+
+/* Benchmark the stages of the cipher on plaintext PLAIN of LEN bytes. */
+static void
+bench_stages(struct handy *cipher, const char *key, int core,
+             const char *plain, size_t len)
+{
+    const char *mode = core ? "core" : "salted";
+    char *chars, *raw, *out, result[2*MAX_ENCODED_LEN], buf[5];
+    size_t i, n, rawlen, rawsize, outlen, calls;
+    int l, c;
+    double t;
+
+    chars = malloc(len);
+    rawsize = 8*len + 2*MAX_ENCODED_LEN;
+    raw = malloc(rawsize);
+    if (!chars || !raw)
+        die("out of memory", "stages");
+    for (i = 0, n = 0; i < len; i++)
+        if (!isspace(CHR(plain[i])))
+            chars[n++] = plain[i];
+
+    /* encode() */
+    check(cipher, handy_init_seeded(cipher, key, core ? HANDY_CORE : 0,
+                                    BENCH_SEED, 0));
+    t = now();
+    for (i = 0, rawlen = 0; i < n; i++) {
+        if (rawsize - rawlen < 2*MAX_ENCODED_LEN) {
+            rawsize *= 2;
+            if (!(raw = realloc(raw, rawsize)))
+                die("out of memory", "encode");
+        }
+        l = encode(cipher, chars[i], i + 1 < n ? chars[i + 1] : EOF,
+                   raw + rawlen);
+        check(cipher, l < 0 ? l : 0);
+        rawlen += l;
+    }
+    report("encode", mode, now() - t, n, n, (double) rawlen / n);
+
+    /* decode() */
+    Parity = 0;
+    t = now();
+    for (i = 0, calls = 0; i < rawlen; calls++) {
+        l = decode(cipher, raw + i,
+                   rawlen - i > INT_MAX ? INT_MAX : (int) (rawlen - i), &c);
+        check(cipher, l < 0 ? l : 0);
+        i += l;
+    }
+    report("decode", mode, now() - t, rawlen, calls, 0);
+
+    /* set_salt() */
+    if (!core) {
+        memcpy(buf, Code_mat, sizeof(buf));
+        t = now();
+        for (i = 0, outlen = 0; i < n; i++)
+            outlen += set_salt(cipher, result, buf, 1 + i % sizeof(buf));
+        report("set_salt", mode, now() - t, outlen, n, 0);
+    }
+
+    /* foutput() */
+    if (!(out = malloc(rawlen + rawlen / 4 + 2)))
+        die("out of memory", "foutput");
+    Col = 0;
+    t = now();
+    for (i = 0, outlen = 0; i < rawlen; i += l) {
+        l = rawlen - i < 2*MAX_ENCODED_LEN ? (int) (rawlen - i)
+                                           : 2*MAX_ENCODED_LEN;
+        outlen += foutput(cipher, out + outlen, raw + i, l);
+    }
+    report("foutput", mode, now() - t, rawlen, rawlen, 0);
+
+    free(out);
+    free(raw);
+    free(chars);
+}
+
+/* The write end of a pipe and the bytes written to it by feed(). */
+struct feed {
+    int fd;
+    const char *buffer;
+    size_t len;
+};
+
+/* Write the bytes of feed ARG to its pipe, then close it. */
+static void *
+feed(void *arg)
+{
+    struct feed *f = arg;
+    size_t i;
+    ssize_t n;
+
+    for (i = 0; i < f->len; i += n)
+        if ((n = write(f->fd, f->buffer + i, f->len - i)) < 0)
+            break;
+    close(f->fd);
+    return 0;
+}
+
+/* Benchmark readchunk() on the LEN bytes of PLAIN, read from a pipe: a
+ * stream which is not mapped in memory is read by chunks. */
+static void
+bench_readchunk(struct handy *cipher, const char *plain, size_t len)
+{
+    struct input in[1];
+    struct feed f[1];
+    pthread_t thread;
+    FILE *file;
+    int fds[2];
+    double t;
+
+    if (pipe(fds) || !(file = fdopen(fds[0], "r")))
+        die("cannot create pipe", strerror(errno));
+    f->fd = fds[1];
+    f->buffer = plain;
+    f->len = len;
+    if (pthread_create(&thread, 0, feed, f))
+        die("cannot start thread", "readchunk");
+    open_input(in, file, &Filters[FILTER_PLAINTEXT], 0, 0);
+    t = now();
+    while (!in->last) {
+        check(cipher, readchunk(cipher, in));
+        in->start = in->end;
+    }
+    report("readchunk", "pipe", now() - t, len, len, 0);
+    close_input(in);
+    pthread_join(thread, 0);
+    fclose(file);
+}
+
+/* Benchmark SHA-256 on LEN bytes of BUFFER and PBKDF2 with every
+ * instruction set of the processor. */
+static void
+bench_sha256(const char *buffer, size_t len)
+{
+    static const char *names[] = {"c", "sha-ni", "avx2"};
+    const uint8_t *pass[SHA256_LANES], *salt[SHA256_LANES];
+    size_t passlen[SHA256_LANES], saltlen[SHA256_LANES];
+    uint8_t hash[32], multi[SHA256_LANES][32], *out[SHA256_LANES];
+    int simd, level, lanes, i;
+    SHA256_CTX sha[1];
+    double t;
+
+    pthread_once(&sha256_once, sha256_cpu);
+    simd = sha256_simd;
+    for (i = 0; i < SHA256_LANES; i++) {
+        pass[i] = (const uint8_t *) "Password";
+        passlen[i] = 8;
+        salt[i] = (const uint8_t *) "NaCl";
+        saltlen[i] = 4;
+        out[i] = multi[i];
+    }
+    /* Each instruction set alone: SHA-256 in plain C for AVX2 */
+    for (level = 0; level < 3; level++) {
+        if ((level & simd) != level)
+            continue;
+        sha256_simd = level;
+        t = now();
+        sha256_init(sha);
+        sha256_update(sha, (const uint8_t *) buffer, len);
+        sha256_final(sha, hash);
+        report("sha256", names[level], now() - t, len, len, 0);
+
+        lanes = level == SHA256_AVX2 ? SHA256_LANES : 1;
+        t = now();
+        sha256_pbkdf2_multi(lanes, pass, passlen, salt, saltlen, 80000, out);
+        t = now() - t;
+        printf("%-10s %-7s %9.1f ms/key\n", "pbkdf2", names[level],
+               t * 1e3 / lanes);
+    }
+    sha256_simd = simd;
+}
+
+/* Generate LEN random numbers with pcg_rand() and by blocks, with each
+ * instruction set the CPU supports. */
+static void
+bench_pcg(size_t len)
+{
+    static const char *names[] = {"c", "avx2", "avx512"};
+    static struct pcgbits bits[1];
+    uint32_t sum = 0;
+    int simd, level;
+    size_t i;
+    double t;
+
+    pcg_seed(bits->rng, BENCH_SEED, 0);
+    t = now();
+    for (i = 0; i < len; i++)
+        sum += pcg_rand(bits->rng);
+    report("pcg", "serial", now() - t, 4 * len, len, 0);
+
+    simd = pcg_cpu();
+    for (level = 0; level <= simd; level++) {
+        pcg_seed(bits->rng, BENCH_SEED, 0);
+        pcg_bitsinit(bits);
+        bits->simd = level;
+        t = now();
+        for (i = 0; i < len; i += PCG_BLOCK) {
+            pcg_fill(bits);
+            sum += bits->block[0];
+        }
+        report("pcg", names[level], now() - t, 4 * i, i, 0);
+    }
+    if (sum == 42) /* keep the loops */
+        putchar('\n');
+}
+
+/* Benchmark handy_encrypt() and handy_decrypt() from stream PLAIN of LEN
+ * bytes, on THREADS threads. */
+static void
+bench_streams(struct handy *cipher, const char *key, int core, int threads,
+              FILE *plain, size_t len)
+{
+    const char *mode = core ? "core" : "salted";
+    FILE *cipherfile, *decrypted;
+    long clen;
+    double t;
+
+    if (!(cipherfile = tmpfile()) || !(decrypted = tmpfile()))
+        die("cannot create temporary file", strerror(errno));
+
+    check(cipher, handy_init_seeded(cipher, key, core ? HANDY_CORE : 0,
+                                    BENCH_SEED, 0));
+    handy_set_threads(cipher, threads);
+    rewind(plain);
+    t = now();
+    check(cipher, handy_encrypt(cipher, plain, cipherfile));
+    fflush(cipherfile);
+    t = now() - t;
+    clen = ftell(cipherfile);
+    report("encrypt", mode, t, len, len, (double) clen / len);
+
+    check(cipher, handy_init_seeded(cipher, key, core ? HANDY_CORE : 0,
+                                    BENCH_SEED, 0));
+    handy_set_threads(cipher, threads);
+    rewind(cipherfile);
+    t = now();
+    check(cipher, handy_decrypt(cipher, cipherfile, decrypted));
+    fflush(decrypted);
+    report("decrypt", mode, now() - t, clen, len, 0);
+
+    fclose(decrypted);
+    fclose(cipherfile);
+}
+
+int
+main(int argc, char **argv)
+{
+    static const struct optparse_name global[] = {
+        {"size",     'n', OPTPARSE_REQUIRED},
+        {"alphabet", 'a', OPTPARSE_REQUIRED},
+        {"threads",  't', OPTPARSE_REQUIRED},
+        {0, 0, 0}
+    };
+    static const char *usage =
+        "usage: handy-bench [-n <size>] [-a <alphabet>] [-t <threads>]";
+    struct optparse options[1];
+    struct filter filter[1];
+    struct handy *cipher;
+    const char *alphabet = BENCH_ALPHABET;
+    char key[51], *plain;
+    size_t len = BENCH_SIZE;
+    int option, threads = 1, core;
+    FILE *file;
+
+    optparse_init(options, argv);
+    while ((option = optparse(options, global)) != OPTPARSE_DONE) {
+        switch (option) {
+        case 'n':
+            len = strtoul(options->optarg, 0, 10);
+            if (!len)
+                die("invalid size", options->optarg);
+            break;
+        case 'a':
+            alphabet = options->optarg;
+            filter_init(filter, FILTER_PLAINTEXT);
+            if (!*alphabet
+                || filter_check(filter, alphabet, strlen(alphabet))
+                   < strlen(alphabet))
+                die("invalid alphabet", options->optarg);
+            break;
+        case 't':
+            threads = atoi(options->optarg);
+            if (threads < 1)
+                die("invalid number of threads", options->optarg);
+            break;
+        default:
+            fprintf(stderr, "%s\n", options->errmsg);
+            fprintf(stderr, "%s\n", usage);
+            exit(EXIT_FAILURE);
+        }
+    }
+    if (optparse_arg(options)) {
+        fprintf(stderr, "%s\n", usage);
+        exit(EXIT_FAILURE);
+    }
+
+    handy_keygen("handy-bench", key);
+    if (!(cipher = handy_new()) || !(plain = malloc(len)))
+        die("out of memory", "main");
+    generate(plain, len, alphabet);
+    file = spill(plain, len);
+
+    printf("%lu bytes of plaintext from \"%s\", %d thread(s)\n",
+           (unsigned long) len, alphabet, threads);
+    for (core = 1; core >= 0; core--) {
+        bench_stages(cipher, key, core, plain, len);
+        bench_streams(cipher, key, core, threads, file, len);
+    }
+    bench_readchunk(cipher, plain, len);
+    bench_sha256(plain, len);
+    bench_pcg(len);
+
+    fclose(file);
+    free(plain);
+    handy_free(cipher);
+    return 0;
+}
@@ -0,0 +1,455 @@
+/* Check the tables of the cipher, its hashes and random generator with
+ * every instruction set, and round trips of messages with every option.
+ * The cipher source is included to reach its internal functions.
+ *
+ * usage: handy-check
+ */
+
+#include "cipher.c"
+
+#define HARNESS_NAME "handy-check"
+#include "harness.h"
+
+/* Plaintext size and alphabet (spaces are ignored by the cipher). */
+#define CHECK_WHOLE     (1024*1024)
+#define CHECK_ALPHABET  "ABCDEFGHIJKLMNOPQRSTUVWXYZ.,?-^     "
+
+/* Seed of the cipher, so that runs check the same ciphertext. */
+#define CHECK_SEED  42
+
+/* Plaintext size of the round trips which do not need the whole one. */
+#define CHECK_SIZE  (256*1024)
+
+/* Check the generated tables of the code matrix against the directions
+ * listed in the reference document. */
+static void
+check_tables(void)
+{
+    static const int spec[20][5] = {
+        {0,5,10,15,20},{1,6,11,16,21},{2,7,12,17,22},{3,8,13,18,23},
+        {4,9,14,19,24},{0,1,2,3,4},{5,6,7,8,9},{10,11,12,13,14},
+        {15,16,17,18,19},{20,21,22,23,24},{0,6,12,18,24},{1,7,13,19,20},
+        {2,8,14,15,21},{3,9,10,16,22},{4,5,11,17,23},{0,9,13,17,21},
+        {1,5,14,18,22},{2,6,10,19,23},{3,7,11,15,24},{4,8,12,16,20}
+    };
+    int d, i, a, b, shared, dir, code;
+    uint32_t jumps;
+
+    for (d = 0; d < 20; d++)
+        for (i = 0; i < 5; i++)
+            if (DIR_SLOT(d, i) != spec[d][i]
+                || !(dir_slots[d] >> spec[d][i] & 1)
+                || DIR_POS(d, spec[d][i]) != i)
+                die("wrong table", "directions");
+    for (code = 1; code < 32; code++)
+        for (d = 0; d < 20; d++)
+            for (i = 0; i < 5; i++)
+                if ((candidates[code][0][d] >> spec[d][i] & 1)
+                    != (code >> i & 1)
+                    || (candidates[code][1][d] >> spec[d][i] & 1)
+                    != (code >> (4 - i) & 1))
+                    die("wrong table", "candidates");
+    for (a = 0; a < 25; a++) {
+        for (jumps = 0, b = 0; b < 25; b++) {
+            for (shared = 0, dir = -1, d = 0; d < 20; d++)
+                if ((dir_slots[d] >> a & 1) && (dir_slots[d] >> b & 1)) {
+                    shared++;
+                    dir = d;
+                }
+            if (a == b ? shared != 4 || pair_dir[a][b] != -2
+                       : shared > 1 || pair_dir[a][b] != dir)
+                die("wrong table", "pairs");
+            if (dir == -1)
+                jumps |= 1UL << b;
+            if ((line_slots[a] >> b & 1) != (dir != -1 || a == b))
+                die("wrong table", "lines");
+        }
+        for (i = 0; i < 8; i++)
+            if (jumps >> knightjumps[a][i] & 1)
+                jumps &= ~(1UL << knightjumps[a][i]);
+            else
+                die("wrong table", "knight-jumps");
+        if (jumps)
+            die("wrong table", "knight-jumps");
+    }
+}
+
+/* Return the contents of stream FILE, of *LEN bytes, in a new buffer. */
+static char *
+slurp(FILE *file, size_t *len)
+{
+    char *buffer;
+    long n;
+
+    if (fflush(file) || fseek(file, 0, SEEK_END) || (n = ftell(file)) < 0
+        || !(buffer = malloc(n + 1)))
+        die("cannot read temporary file", strerror(errno));
+    rewind(file);
+    if (fread(buffer, 1, n, file) != (size_t) n)
+        die("cannot read temporary file", strerror(errno));
+    *len = n;
+    return buffer;
+}
+
+/* Check that stream OUT holds the LEN bytes of EXPECT, as decrypted by
+ * test NAME. Unless EXACT, hyphens are ignored: the cipher may add some
+ * to plaintext which is not escaped. */
+static void
+check_output(FILE *out, const char *expect, size_t len, int exact,
+             const char *name)
+{
+    char *got;
+    size_t i, n, m;
+
+    got = slurp(out, &n);
+    if (!exact) {
+        for (i = 0, m = 0; i < n; i++)
+            if (got[i] != '-')
+                got[m++] = got[i];
+        n = m;
+    }
+    if (n != len || memcmp(got, expect, len))
+        die("wrong decryption", name);
+    free(got);
+}
+
+/* Return a new temporary stream. */
+static FILE *
+temporary(void)
+{
+    FILE *file;
+
+    if (!(file = tmpfile()))
+        die("cannot create temporary file", strerror(errno));
+    return file;
+}
+
+/* Encrypt the LEN bytes of PLAIN with FLAGS and DENSITY on THREADS
+ * threads, then check that decrypting the ciphertext gives the ELEN bytes
+ * of EXPECT, and its ranges the same characters if it is framed. A
+ * ciphertext with a MAC is then tampered with and must be rejected. */
+static void
+check_roundtrip(struct handy *cipher, const char *key, int flags, int density,
+                int threads, const char *plain, size_t len,
+                const char *expect, size_t elen, const char *name)
+{
+    FILE *in, *ciphertext, *out;
+    char *data;
+    size_t n, start, end;
+
+    in = spill(plain, len);
+    ciphertext = temporary();
+    check(cipher, handy_init_seeded(cipher, key, flags, CHECK_SEED, 0));
+    handy_set_threads(cipher, threads);
+    handy_set_density(cipher, density);
+    check(cipher, handy_encrypt(cipher, in, ciphertext));
+    fclose(in);
+
+    out = temporary();
+    rewind(ciphertext);
+    check(cipher, handy_init_seeded(cipher, key, flags, CHECK_SEED, 0));
+    handy_set_threads(cipher, threads);
+    check(cipher, handy_decrypt(cipher, ciphertext, out));
+    check_output(out, expect, elen, flags & HANDY_ESCAPE, name);
+
+    if (flags & HANDY_FRAMED) {
+        /* ranges crossing frames, from any character */
+        data = slurp(out, &n);
+        for (start = 0; start < n; start += n / 5 + 1) {
+            end = start + n / 5 + FRAME_SIZE < n ? start + n / 5 + FRAME_SIZE
+                                                 : n;
+            fclose(out);
+            out = temporary();
+            rewind(ciphertext);
+            handy_reset(cipher);
+            check(cipher, handy_decrypt_range(cipher, ciphertext, out,
+                                              start, end));
+            check_output(out, data + start, end - start, 1, name);
+        }
+        free(data);
+    }
+    fclose(out);
+
+    if (flags & HANDY_MAC) {
+        /* change the last digit of the trailer */
+        data = slurp(ciphertext, &n);
+        data[n - 2] = data[n - 2] == '0' ? '1' : '0';
+        in = spill(data, n);
+        free(data);
+        out = temporary();
+        check(cipher, handy_init_seeded(cipher, key, flags, CHECK_SEED, 0));
+        handy_set_threads(cipher, threads);
+        if (handy_decrypt(cipher, in, out) != HANDY_EMAC)
+            die("tampered ciphertext accepted", name);
+        fclose(out);
+        fclose(in);
+    }
+    fclose(ciphertext);
+}
+
+/* Check that messages encrypted and decrypted in turn by one context,
+ * reset between them, and by its clone decrypt to the LEN bytes of
+ * EXPECT. */
+static void
+check_batch(struct handy *cipher, const char *key, const char *plain,
+            size_t len, const char *expect, size_t elen)
+{
+    struct handy *clone;
+    FILE *in, *ciphertext[3], *out;
+    int i;
+
+    check(cipher, handy_init_seeded(cipher, key, 0, CHECK_SEED, 0));
+    for (i = 0; i < 3; i++) {
+        in = spill(plain, len);
+        ciphertext[i] = temporary();
+        handy_reset(cipher);
+        check(cipher, handy_encrypt(cipher, in, ciphertext[i]));
+        fclose(in);
+    }
+    if (!(clone = handy_clone(cipher)))
+        die("out of memory", "batch");
+    for (i = 0; i < 3; i++) {
+        out = temporary();
+        rewind(ciphertext[i]);
+        handy_reset(i % 2 ? clone : cipher);
+        check(cipher, handy_decrypt(i % 2 ? clone : cipher, ciphertext[i],
+                                    out));
+        check_output(out, expect, elen, 0, "batch");
+        fclose(out);
+        fclose(ciphertext[i]);
+    }
+    handy_free(clone);
+}
+
+/* Check that a ciphertext of the LEN bytes of PLAIN with a MAC decrypts on
+ * two threads when its trailer starts at the end of their first batch or
+ * within a few sequences past it, where it is moved by leading spaces. */
+static void
+check_trailers(struct handy *cipher, const char *key, const char *plain,
+               size_t len)
+{
+    FILE *in, *ciphertext, *out;
+    char *data, *padded, *expect;
+    size_t i, n, m, z, pad, size = 2*SEGMENT_SIZE;
+
+    if (!(expect = malloc(len)))
+        die("out of memory", "mac trailer");
+    for (i = 0, m = 0; i < len; i++)
+        if (!isspace(CHR(plain[i])) && plain[i] != '-')
+            expect[m++] = plain[i];
+    in = spill(plain, len);
+    ciphertext = temporary();
+    check(cipher, handy_init_seeded(cipher, key, HANDY_MAC, CHECK_SEED, 0));
+    check(cipher, handy_encrypt(cipher, in, ciphertext));
+    fclose(in);
+    data = slurp(ciphertext, &n);
+    fclose(ciphertext);
+    for (z = n; z > 0 && data[z - 1] != 'Z'; z--)
+        ;
+    if (!z-- || z > size)
+        die("no trailer", "mac trailer");
+    if (!(padded = malloc(size + 2*MAX_ENCODED_LEN + n)))
+        die("out of memory", "mac trailer");
+
+    for (i = 0; i <= 2*MAX_ENCODED_LEN; i++) {
+        pad = size + i - z;
+        memset(padded, ' ', pad);
+        memcpy(padded + pad, data, n);
+        in = spill(padded, pad + n);
+        out = temporary();
+        check(cipher, handy_init_seeded(cipher, key, HANDY_MAC, CHECK_SEED,
+                                        0));
+        handy_set_threads(cipher, 2);
+        check(cipher, handy_decrypt(cipher, in, out));
+        check_output(out, expect, m, 0, "mac trailer");
+        fclose(out);
+        fclose(in);
+    }
+    free(padded);
+    free(data);
+    free(expect);
+}
+
+/* Check that the LEN bytes of PLAIN, drawn from a plaintext alphabet,
+ * decrypt to themselves without spaces and hyphens with every option, or
+ * with runs of spaces as '^' when compressed, and that arbitrary bytes do
+ * when escaped, lowercase letters aside. */
+static void
+check_roundtrips(struct handy *cipher, const char *key, const char *plain,
+                 size_t len)
+{
+    static const struct {
+        int flags, density, threads;
+        int whole;  /* true to use the whole plaintext */
+        const char *name;
+    } tests[] = {
+        {0, HANDY_DENSITY, 1, 1, "default"},
+        {0, HANDY_DENSITY, 4, 1, "threads"},
+        {HANDY_CORE, HANDY_DENSITY, 4, 1, "core threads"},
+        {HANDY_MAC, HANDY_DENSITY, 4, 1, "mac threads"},
+        {HANDY_MAC, HANDY_DENSITY, 1, 0, "mac"},
+        {HANDY_PACKED, HANDY_DENSITY, 2, 1, "packed"},
+        {0, 0, 2, 0, "density 0"},
+        {0, 100, 2, 0, "density 100"},
+        {HANDY_FRAMED, HANDY_DENSITY, 1, 0, "framed"},
+        {HANDY_FRAMED, HANDY_DENSITY, 4, 1, "framed threads"}
+    };
+    struct pcgstate rng[1];
+    char *expect, *spaced, *bytes, *upper;
+    size_t i, n, m, small = len < CHECK_SIZE ? len : CHECK_SIZE;
+    int space;
+
+    if (!(expect = malloc(len)) || !(spaced = malloc(len))
+        || !(bytes = malloc(small)) || !(upper = malloc(small)))
+        die("out of memory", "round trips");
+    for (i = 0, n = 0, m = 0; i < len; i++)
+        if (!isspace(CHR(plain[i])) && plain[i] != '-') {
+            expect[n++] = plain[i];
+            m += i < small;
+        }
+    for (i = 0; i < sizeof(tests) / sizeof(*tests); i++)
+        check_roundtrip(cipher, key, tests[i].flags, tests[i].density,
+                        tests[i].threads, plain, tests[i].whole ? len : small,
+                        expect, tests[i].whole ? n : m, tests[i].name);
+    check_batch(cipher, key, plain, small, expect, m);
+
+    /* Inner runs of spaces are kept as '^' by compression */
+    for (i = 0, n = 0, space = 0; i < len; i++) {
+        if (isspace(CHR(plain[i]))) {
+            space = n > 0;
+            continue;
+        }
+        if (space)
+            spaced[n++] = '^';
+        space = 0;
+        if (plain[i] != '-')
+            spaced[n++] = plain[i];
+    }
+    check_roundtrip(cipher, key, HANDY_COMPRESS, HANDY_DENSITY, 3, plain, len,
+                    spaced, n, "compress");
+
+    pcg_seed(rng, CHECK_SEED, 2);
+    for (i = 0; i < small; i++) {
+        bytes[i] = (char) pcg_boundedrand(rng, 256);
+        upper[i] = bytes[i] >= 'a' && bytes[i] <= 'z'
+                   ? bytes[i] - 'a' + 'A' : bytes[i];
+    }
+    check_roundtrip(cipher, key, HANDY_ESCAPE, HANDY_DENSITY, 2, bytes,
+                    small, upper, small, "escape");
+    check_roundtrip(cipher, key, HANDY_ESCAPE | HANDY_COMPRESS | HANDY_MAC,
+                    HANDY_DENSITY, 1, bytes, small, upper, small,
+                    "escape compress mac");
+
+    free(upper);
+    free(bytes);
+    free(spaced);
+    free(expect);
+}
+
+/* Check SHA-256 and PBKDF2 with every instruction set of the processor
+ * against test vectors, and on LEN bytes of BUFFER against plain C. */
+static void
+check_sha256(const char *buffer, size_t len)
+{
+    static const char *names[] = {"c", "sha-ni", "avx2"};
+    static const uint8_t abc[32] = {
+        0xba, 0x78, 0x16, 0xbf, 0x8f, 0x01, 0xcf, 0xea, 0x41, 0x41, 0x40, 0xde,
+        0x5d, 0xae, 0x22, 0x23, 0xb0, 0x03, 0x61, 0xa3, 0x96, 0x17, 0x7a, 0x9c,
+        0xb4, 0x10, 0xff, 0x61, 0xf2, 0x00, 0x15, 0xad
+    };
+    static const uint8_t nacl[8] = { /* RFC 7914, 80000 iterations */
+        0x4d, 0xdc, 0xd8, 0xf6, 0x0b, 0x98, 0xbe, 0x21
+    };
+    const uint8_t *pass[SHA256_LANES], *salt[SHA256_LANES];
+    size_t passlen[SHA256_LANES], saltlen[SHA256_LANES];
+    uint8_t hash[32], first[32], multi[SHA256_LANES][32], *out[SHA256_LANES];
+    int simd, level, lanes, i;
+    SHA256_CTX sha[1];
+
+    pthread_once(&sha256_once, sha256_cpu);
+    simd = sha256_simd;
+    for (i = 0; i < SHA256_LANES; i++) {
+        pass[i] = (const uint8_t *) "Password";
+        passlen[i] = 8;
+        salt[i] = (const uint8_t *) "NaCl";
+        saltlen[i] = 4;
+        out[i] = multi[i];
+    }
+    /* Each instruction set alone: SHA-256 in plain C for AVX2 */
+    for (level = 0; level < 3; level++) {
+        if ((level & simd) != level)
+            continue;
+        sha256_simd = level;
+        sha256_init(sha);
+        sha256_update(sha, (const uint8_t *) "abc", 3);
+        sha256_final(sha, hash);
+        if (memcmp(hash, abc, 32))
+            die("wrong sha256 digest", names[level]);
+
+        sha256_init(sha);
+        sha256_update(sha, (const uint8_t *) buffer, len);
+        sha256_final(sha, hash);
+        if (!level)
+            memcpy(first, hash, 32);
+        else if (memcmp(hash, first, 32))
+            die("wrong sha256 digest", names[level]);
+
+        lanes = level == SHA256_AVX2 ? SHA256_LANES : 1;
+        sha256_pbkdf2_multi(lanes, pass, passlen, salt, saltlen, 80000, out);
+        for (i = 0; i < lanes; i++)
+            if (memcmp(multi[i], nacl, sizeof(nacl)))
+                die("wrong pbkdf2 result", names[level]);
+    }
+    sha256_simd = simd;
+}
+
+/* Check that blocks of random numbers do not depend on the instruction set
+ * the CPU supports. */
+static void
+check_pcg(void)
+{
+    static const char *names[] = {"c", "avx2", "avx512"};
+    static struct pcgbits bits[1];
+    uint32_t first[PCG_BLOCK];
+    int simd, level;
+
+    simd = pcg_cpu();
+    for (level = 0; level <= simd; level++) {
+        pcg_seed(bits->rng, CHECK_SEED, 0);
+        pcg_bitsinit(bits);
+        bits->simd = level;
+        pcg_fill(bits);
+        if (!level)
+            memcpy(first, bits->block, sizeof(first));
+        else if (memcmp(first, bits->block, sizeof(first)))
+            die("wrong pcg block", names[level]);
+    }
+}
+
+int
+main(int argc, char **argv)
+{
+    struct handy *cipher;
+    char key[51], *plain;
+    size_t len = CHECK_WHOLE;
+
+    if (argc > 1) {
+        fprintf(stderr, "usage: handy-check\n");
+        exit(EXIT_FAILURE);
+    }
+    handy_keygen("handy-check", key);
+    if (!(cipher = handy_new()) || !(plain = malloc(len)))
+        die("out of memory", "main");
+    generate(plain, len, CHECK_ALPHABET);
+
+    check_tables();
+    check_sha256(plain, len);
+    check_pcg();
+    check_roundtrips(cipher, key, plain, len);
+    check_trailers(cipher, key, plain, CHECK_SIZE / 16);
+    puts("all checks passed");
+
+    free(plain);
+    handy_free(cipher);
+    return 0;
+}
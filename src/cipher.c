@@ -1,46 +1,228 @@
-/* Encrypt streams with the Handycipher. Read the reference document:
+/* Encrypt and decrypt with the Handycipher. Read the reference document:
  *   Handycipher: a Low-tech, Randomized, Symmetric-key Cryptosystem
  * by Bruce Kallick.
  */
 
+#define _POSIX_C_SOURCE 200112L
+
 #include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
 #include <stddef.h>
 #include <string.h>
 #include <ctype.h>
+#include <limits.h>
+#include <pthread.h>
 #include <sys/errno.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 #define PCGRANDOM_IMPLEMENTATION
 #define PCGRANDOM_API static
 #include "pcgrandom.h"
 
 #define SHA256_IMPLEMENTATION
+#define SHA256_API static
 #include "sha256.h"
 
-extern void fatal(const char *fmt, ...);
-extern void warning(const char *fmt, ...);
-
-/* The indexes  of the 20 directions in a 5x5 torus-matrix:
- * columns 0-4, rows 5-9, right diagonals 10-14, left diagonal 15-19. */
-static const int directions[20][5] = {
-    {0,5,10,15,20},{1,6,11,16,21},{2,7,12,17,22},{3,8,13,18,23},{4,9,14,19,24},
-    {0,1,2,3,4},{5,6,7,8,9},{10,11,12,13,14},{15,16,17,18,19},{20,21,22,23,24},
-    {0,6,12,18,24},{1,7,13,19,20},{2,8,14,15,21},{3,9,10,16,22},{4,5,11,17,23},
-    {0,9,13,17,21},{1,5,14,18,22},{2,6,10,19,23},{3,7,11,15,24},{4,8,12,16,20}
+/* Instruction sets of sha256.h, found once for all threads. */
+static pthread_once_t sha256_once = PTHREAD_ONCE_INIT;
+
+#define FILTER_IMPLEMENTATION
+#define FILTER_API static
+#include "filter.h"
+
+#include "handy.h"
+
+/* The code matrix is a 5x5 torus: slot 5*r+c is on row r and column c.
+ * Its tables are generated from this geometry by the following macros. */
+
+/* Repeat macro M on 5, 20 or 25 consecutive arguments. */
+#define REP5(m, a) m(a), m(a + 1), m(a + 2), m(a + 3), m(a + 4)
+#define REP20(m) REP5(m, 0), REP5(m, 5), REP5(m, 10), REP5(m, 15)
+#define REP25(m) REP20(m), REP5(m, 20)
+#define REP5X(m, x, a) m(x, a), m(x, a + 1), m(x, a + 2), m(x, a + 3), \
+                       m(x, a + 4)
+#define REP25X(m, x) REP5X(m, x, 0), REP5X(m, x, 5), REP5X(m, x, 10), \
+                     REP5X(m, x, 15), REP5X(m, x, 20)
+#define REP20XY(m, x, y) \
+    m(x, y, 0), m(x, y, 1), m(x, y, 2), m(x, y, 3), m(x, y, 4), \
+    m(x, y, 5), m(x, y, 6), m(x, y, 7), m(x, y, 8), m(x, y, 9), \
+    m(x, y, 10), m(x, y, 11), m(x, y, 12), m(x, y, 13), m(x, y, 14), \
+    m(x, y, 15), m(x, y, 16), m(x, y, 17), m(x, y, 18), m(x, y, 19)
+#define REP32(m) REP25(m), m(25), m(26), m(27), m(28), m(29), m(30), m(31)
+
+/* Slot of row R and column C, modulo 5. */
+#define SLOT(r, c) (5 * ((r) % 5) + (c) % 5)
+#define ROW(s) ((s) / 5)
+#define COL(s) ((s) % 5)
+
+/* The 20 directions: columns 0-4, rows 5-9, right diagonals 10-14 and left
+ * diagonals 15-19. Slot I of direction D is on row I, except for rows. */
+#define DIR_SLOT(d, i) \
+    ((d) < 5 ? SLOT(i, d) : (d) < 10 ? SLOT((d) - 5, i) : \
+     (d) < 15 ? SLOT(i, (d) - 10 + (i)) : SLOT(i, (d) - 15 + 5 - (i)))
+#define DIR_MASK(d) \
+    (1UL << DIR_SLOT(d, 0) | 1UL << DIR_SLOT(d, 1) | 1UL << DIR_SLOT(d, 2) \
+     | 1UL << DIR_SLOT(d, 3) | 1UL << DIR_SLOT(d, 4))
+
+/* Position (0-4) of slot S in a direction D containing it. */
+#define DIR_POS(d, s) ((d) >= 5 && (d) < 10 ? COL(s) : ROW(s))
+
+/* The 4 directions of slot S: its column, row and diagonals. */
+#define SLOT_DIR(s, k) \
+    ((k) == 0 ? COL(s) : (k) == 1 ? 5 + ROW(s) : \
+     (k) == 2 ? 10 + (COL(s) + 5 - ROW(s)) % 5 : 15 + (COL(s) + ROW(s)) % 5)
+
+/* Direction shared by slots A and B, -2 if they are the same slot, or -1 if
+ * they are not colinear: B is then a knight-jump away from A. */
+#define PAIR_DR(a, b) ((ROW(b) + 5 - ROW(a)) % 5)
+#define PAIR_DC(a, b) ((COL(b) + 5 - COL(a)) % 5)
+#define PAIR_DIR(a, b) \
+    ((a) == (b) ? -2 : \
+     PAIR_DC(a, b) == 0 ? SLOT_DIR(a, 0) : \
+     PAIR_DR(a, b) == 0 ? SLOT_DIR(a, 1) : \
+     PAIR_DR(a, b) == PAIR_DC(a, b) ? SLOT_DIR(a, 2) : \
+     PAIR_DR(a, b) + PAIR_DC(a, b) == 5 ? SLOT_DIR(a, 3) : -1)
+#define PAIR_DIRS(a) {REP25X(PAIR_DIR, a)}
+
+/* The slots colinear with slot S, S included. */
+#define LINE_MASK(s) \
+    (DIR_MASK(SLOT_DIR(s, 0)) | DIR_MASK(SLOT_DIR(s, 1)) \
+     | DIR_MASK(SLOT_DIR(s, 2)) | DIR_MASK(SLOT_DIR(s, 3)))
+#define ALL_SLOTS 0x1ffffffUL
+
+/* The 8 knight-jumps from slot S, the slots colinear with none of its
+ * directions. */
+#define KNIGHT_JUMPS(s) \
+    {SLOT(ROW(s) + 1, COL(s) + 2), SLOT(ROW(s) + 1, COL(s) + 3), \
+     SLOT(ROW(s) + 2, COL(s) + 1), SLOT(ROW(s) + 2, COL(s) + 4), \
+     SLOT(ROW(s) + 3, COL(s) + 1), SLOT(ROW(s) + 3, COL(s) + 4), \
+     SLOT(ROW(s) + 4, COL(s) + 2), SLOT(ROW(s) + 4, COL(s) + 3)}
+
+/* The slots encoding CODE with PARITY in direction D: bit 4-I of CODE
+ * selects slot I of D, or slot 4-I with odd parity. */
+#define CAND_SLOT(code, p, d, i) \
+    ((code) >> (4 - (i)) & 1 ? 1UL << DIR_SLOT(d, (p) ? (i) : 4 - (i)) : 0)
+#define CAND_MASK(code, p, d) \
+    (CAND_SLOT(code, p, d, 0) | CAND_SLOT(code, p, d, 1) \
+     | CAND_SLOT(code, p, d, 2) | CAND_SLOT(code, p, d, 3) \
+     | CAND_SLOT(code, p, d, 4))
+#define CAND_MASKS(code) \
+    {{REP20XY(CAND_MASK, code, 0)}, {REP20XY(CAND_MASK, code, 1)}}
+
+/* The slots of each direction, as a 25-bit mask. */
+static const uint32_t dir_slots[20] = {REP20(DIR_MASK)};
+
+/* PAIR_DIR() of each pair of slots. */
+static const signed char pair_dir[25][25] = {REP25(PAIR_DIRS)};
+
+/* LINE_MASK() of each slot. */
+static const uint32_t line_slots[25] = {REP25(LINE_MASK)};
+
+/* CAND_MASK() of each code (1-31), parity and direction. */
+static const uint32_t candidates[32][2][20] = {REP32(CAND_MASKS)};
+
+/* The knight-jumps from each slot. */
+static const unsigned char knightjumps[25][8] = {REP25(KNIGHT_JUMPS)};
+
+/* The 5 bits of a code in reverse order, for the odd parity. */
+#define REVERSE5(m) \
+    (((m) & 1) << 4 | ((m) & 2) << 2 | ((m) & 4) | ((m) & 8) >> 2 \
+     | ((m) & 16) >> 4)
+static const unsigned char reverse5[32] = {REP32(REVERSE5)};
+
+/* The decoder is a state machine reading one ciphertext symbol at a time:
+ * the slot (0-24) of a code character, or one of the following. */
+#define SYM_NULL   25   /* null character, or space */
+#define SYM_BAD    26   /* invalid character */
+#define SYM_END    27   /* end of input, not a character */
+#define SYMBOLS    28
+
+/* Its states are: DEC_START before the first code character, DEC_FIRST + S
+ * after a first code character in slot S, and DEC_STATE() after POS (2-5)
+ * code characters of direction DIR, the last one at index I of DIR, and
+ * possibly a NOISE character. */
+#define DEC_START  0
+#define DEC_FIRST  1
+#define DEC_STATE(pos, noise, dir, i) \
+    (26 + (((pos) - 2) * 2 + (noise)) * 100 + (dir) * 5 + (i))
+#define DEC_STATES 826
+
+/* The number of code characters and the direction of DEC_STATE() STATE. */
+#define DEC_POS(state) (((state) - DEC_STATE(2, 0, 0, 0)) / 200 + 2)
+#define DEC_DIR(state) (((state) - DEC_STATE(2, 0, 0, 0)) % 100 / 5)
+
+/* A transition is the next state, or one of the following actions, and in
+ * bits DEC_BITS and above the bits of the code read (1 << I for the
+ * character at index I of the direction). */
+#define DEC_END    1020  /* the sequence ended before this symbol */
+#define DEC_EINPUT 1021  /* invalid character */
+#define DEC_ENOISE 1022  /* noise following noise */
+#define DEC_ELONG  1023  /* 6 characters in the direction */
+#define DEC_BITS   10
+#define DEC_NEXT   ((1 << DEC_BITS) - 1)
+
+/* The transitions of each state and symbol, filled once by init_decoder()
+ * for all contexts. */
+static uint16_t decoder[DEC_STATES][SYMBOLS];
+static pthread_once_t decoder_once = PTHREAD_ONCE_INIT;
+
+/* Compressed plaintext replaces the longest tokens of the plaintext by
+ * codes of the symbols of CODE_SYMBOLS, which is the plaintext alphabet
+ * without the hyphen: hyphens added by the cipher are ignored. Symbols are
+ * ranked by the weight of their code in the key, the number of characters
+ * encoding them. The first TOKENS_SINGLE tokens, frequent in English text
+ * with '^' for spaces and in decreasing order of frequency, are coded by the
+ * symbol of their rank; the others by the escape symbol, of rank ESCAPE,
+ * followed by a symbol. */
+#define TOKENS         59
+#define TOKENS_SINGLE  29
+#define TOKEN_MAX      6
+#define CODE_SYMBOLS   "ABCDEFGHIJKLMNOPQRSTUVWXYZ.,?^"
+#define ESCAPE         29
+
+static const char *const tokens[TOKENS] = {
+    "^", "E", "T", "A", "O", "I", "N", "S", "H", "R", "D", "L", "C", "U",
+    "M", "W", "F", "G", "Y", "P", "B", "IN", "^THE^", "ER", "^A", "^T",
+    "OR", "RE", ",^",
+    "V", "K", "X", "J", "Q", "Z", ".", ",", "?", "-", "ION", "^OF", "ED^",
+    "THE", "VER", "^TO^", "ENT", "^TH", "VE", "CON", "ATE", "^AND^",
+    "^FOR^", "^THAT^", "^IS^", "^WITH^", "^BE^", "HIS", "SE", ".^"
 };
 
-/* The indexes of the non-colinear slots in a 5x5 torus-matrix:
- * from starting slot 0-24, we can knight-jump to 8 others. */
-static const int knightjumps[25][8] = {
-    {7,8,11,14,16,19,22,23},{8,9,10,12,15,17,23,24},{5,9,11,13,16,18,20,24},
-    {5,6,12,14,17,19,20,21},{6,7,10,13,15,18,21,22},{2,3,12,13,16,19,21,24},
-    {3,4,13,14,15,17,20,22},{0,4,10,14,16,18,21,23},{0,1,10,11,17,19,22,24},
-    {1,2,11,12,15,18,20,23},{1,4,7,8,17,18,21,24},{0,2,8,9,18,19,20,22},
-    {1,3,5,9,15,19,21,23},{2,4,5,6,15,16,22,24},{0,3,6,7,16,17,20,23},
-    {1,4,6,9,12,13,22,23},{0,2,5,7,13,14,23,24},{1,3,6,8,10,14,20,24},
-    {2,4,7,9,10,11,20,21},{0,3,5,8,11,12,21,22},{2,3,6,9,11,14,17,18},
-    {3,4,5,7,10,12,18,19},{0,4,6,8,11,13,15,19},{0,1,7,9,12,14,15,16},
-    {1,2,5,8,10,13,16,17}
-};
+/* Lookup tables of the tokens, filled once by init_tokens(). */
+static signed char token_first[256];   /* longest token starting with
+                                          character, or -1 */
+static signed char token_next[TOKENS]; /* next token with the same first
+                                          character, not longer, or -1 */
+static unsigned char token_len[TOKENS];
+static signed char symbol_code[256];   /* index in CODE_SYMBOLS, or -1 */
+static pthread_once_t tokens_once = PTHREAD_ONCE_INIT;
+
+/* Escaped plaintext codes any byte by symbols of CODE_SYMBOLS: letters, '.'
+ * and ',' by themselves, lowercase letters as uppercase ones, and spaces by
+ * '^'. Other bytes are coded by the escape symbol '?' followed by a symbol
+ * for the ESC_SINGLE bytes of ESC_CHARS, or by two symbols, the first one
+ * following those of ESC_CHARS, for the others in increasing order. The
+ * hyphen is not used: hyphens added by the cipher are ignored. */
+#define ESC_SYMBOL  28
+#define ESC_SINGLE  23
+#define ESC_CHARS   "0123456789\n?-^'\"():;!/\t"
+#define ESC_MAX     3
+
+/* Decoding states of escaped plaintext: 0 between bytes, 1 after the escape
+ * symbol and 2 to ESC_STATES - 1 after each first of two symbols. */
+#define ESC_STATES  9
+#define ESC_STATE(s) (256 + (s))
+
+/* Lookup tables of escaped plaintext, filled once by init_escapes().
+ * ESC_NEXT gives, for each state and index in CODE_SYMBOLS, the byte
+ * decoded, the next ESC_STATE(), or -1 for an invalid symbol. */
+static char esc_codes[256][ESC_MAX];    /* symbols coding each byte */
+static unsigned char esc_len[256];
+static short esc_next[ESC_STATES][sizeof(CODE_SYMBOLS) - 1];
+static pthread_once_t escapes_once = PTHREAD_ONCE_INIT;
 
 /* The cipher main structure. */
 struct handy {
@@ -48,14 +230,67 @@ struct handy {
     char subkey[31];
     char code_mat[25];
     char null_mat[25];
-    struct pcgstate random[1];
+    struct pcgbits random[1];
     int core;
+    int trace;
+    int framed;
+    int packed;
+    int compress;
+    int escape;
+    int density;            /* probability of nulls and noises, in 256ths */
+    int threads;
+    char errmsg[128];
+
+    /* Input filters, indexed by FILTER_CIPHERTEXT and FILTER_PLAINTEXT */
+    struct filter filters[2];
+
+    /* Lookup tables derived from the key, indexed by character */
+    char code_of[256];      /* code (1-31) or 0 if not in subkey */
+    signed char slot_of[256]; /* slot in code matrix or -1 */
+    char is_null[256];      /* true if in null matrix */
+    char flip[256];         /* character of reversed code, for other parity */
+    char sym_of[256];       /* symbol read by the decoder */
+
+    /* Symbols of compressed plaintext by rank, and their ranks (or -1) */
+    char rank_sym[sizeof(CODE_SYMBOLS) - 1];
+    signed char sym_rank[256];
+
+    /* Permutations of 1 to 5 indexes, by rank */
+    char perms[153][5];
 
     /* Context needed to encode a character */
     int prev_code;
     int prev_last;
     int prev_dir;
     int parity;
+
+    /* Number of non-space chars in current line of ciphertext */
+    int col;
+
+    /* Packed ciphertext letters not yet written, see pack_output() */
+    uint64_t pack_word;
+    int pack_len;           /* number of letters, -1 before the header */
+
+    /* State of the expansion of decrypted compressed plaintext: 1 after an
+     * escape symbol, 0 otherwise, -1 if not expanding */
+    int expand;
+
+    /* State of the decoding of decrypted escaped plaintext (see ESC_STATES),
+     * -1 if not decoding */
+    int unescape;
+
+    /* Writer thread of the output stream of handy_encrypt() or
+     * handy_decrypt(), or 0 */
+    struct ring *writer;
+    FILE *write_to;         /* stream to give to a writer thread, or 0 */
+    size_t written;         /* bytes written to WRITE_TO without thread */
+
+    /* HMAC of the non-space ciphertext characters, see mac_trailer() */
+    int mac;                /* true if the ciphertext has a MAC trailer */
+    uint8_t mac_key[32];
+    SHA256_CTX mac_ctx[2];  /* inner and outer contexts */
+    int tag_len;            /* characters of the trailer read, -1 before */
+    uint8_t tag[32];        /* MAC read from the trailer */
 };
 
 #define Key        cipher->key
@@ -64,90 +299,203 @@ struct handy {
 #define Null_mat   cipher->null_mat
 #define Random     cipher->random
 #define Core       cipher->core
+#define Trace      cipher->trace
+#define Framed     cipher->framed
+#define Packed     cipher->packed
+#define Compress   cipher->compress
+#define Escape     cipher->escape
+#define Density    cipher->density
+#define Threads    cipher->threads
+#define Errmsg     cipher->errmsg
+#define Filters    cipher->filters
+#define Code_of    cipher->code_of
+#define Slot_of    cipher->slot_of
+#define Is_null    cipher->is_null
+#define Flip       cipher->flip
+#define Sym_of     cipher->sym_of
+#define Rank_sym   cipher->rank_sym
+#define Sym_rank   cipher->sym_rank
+#define Perms      cipher->perms
 #define Prev_code  cipher->prev_code
 #define Prev_last  cipher->prev_last
 #define Prev_dir   cipher->prev_dir
 #define Parity     cipher->parity
+#define Col        cipher->col
+#define Pack_word  cipher->pack_word
+#define Pack_len   cipher->pack_len
+#define Expand     cipher->expand
+#define Unescape   cipher->unescape
+#define Writer     cipher->writer
+#define Write_to   cipher->write_to
+#define Written    cipher->written
+#define Mac        cipher->mac
+#define Mac_key    cipher->mac_key
+#define Mac_ctx    cipher->mac_ctx
+#define Tag_len    cipher->tag_len
+#define Tag        cipher->tag
+
+/* Index a lookup table with character C. */
+#define CHR(c) ((unsigned char) (c))
 
 /* Maximum length of one encoded character:
  * (5 codes) + (4 noises) + (23 nulls) = 32. */
 #define MAX_ENCODED_LEN  32
 
-/* Input chunk size. */
-#define CHUNK_SIZE  (MAX_ENCODED_LEN*1024)
+/* Maximum length of 2*MAX_ENCODED_LEN formatted characters:
+ * (64 chars) + (13 spaces) + (2 newlines) = 79. */
+#define MAX_FORMATTED_LEN  79
 
-/* A trace flag for the cipher. */
-static int handy_trace = 0;
+/* Length of the MAC trailer line: "Zmac", a space, 64 hexadecimal digits
+ * and a newline. */
+#define MAC_LINE  70
 
-/* Return true if character C belongs to direction DIR. */
-static int
-has_direction(struct handy *cipher, int c, int dir)
-{
-    int i;
+/* Packed ciphertext: a header line, then words of 8 bytes (little-endian)
+ * each holding PACKED_LETTERS letters as a base-50 number, A-Y being the
+ * digits 0-24 and a-y 25-49. The last word holds the K (0-10) remaining
+ * letters as PACKED_FULL + K*PACKED_TENTH + their number. */
+#define PACKED_HEADER  "Zhandy packed\n"
+#define PACKED_HEADER_LEN  14
+#define PACKED_LETTERS  11
+#define PACKED_FULL   4882812500000000000ULL    /* 50^11 */
+#define PACKED_TENTH  97656250000000000ULL      /* 50^10 */
 
-    for (i = 0; i < 5; i++)
-        if (Code_mat[directions[dir][i]] == c)
-            return 1;
-    return 0;
-}
+/* Length of the header and last word of packed ciphertext. */
+#define PACKED_END  (PACKED_HEADER_LEN + 8)
 
-/* Return the direction defined by characters A and B or -1 if not colinear. */
-static int
-get_direction(struct handy *cipher, int a, int b)
-{
-    int i, j, c, found;
+/* Input chunk size, also the input size processed by one call. */
+#define CHUNK_SIZE  (MAX_ENCODED_LEN*1024)
 
-    for (i = 0; i < 20; i++) {
-        for (found = 0, j = 0; j < 5 && found < 2; j++) {
-            c = Code_mat[directions[i][j]];
-            if (c == a || c == b)
-                found++;
-        }
-        if (found == 2)
-            return i;
-    }
-    return -1;
-}
-/* Return true if characters A and B are colinear. */
-static int
-colinear(struct handy *cipher, int a, int b)
-{
-    int i, j;
+/* Output buffer size of streams. */
+#define OUTPUT_SIZE  (64*1024)
+
+/* Plaintext size encrypted at once by each thread. */
+#define SEGMENT_SIZE  (1024*1024)
+
+/* Number of buffers of a ring between the cipher and an I/O thread. */
+#define RING_SLOTS  8
+
+/* Size of each buffer of a ring: a ring holds two segments whatever the
+ * number of threads. */
+#define RING_SIZE  (SEGMENT_SIZE/4)
+
+/* Bytes read or written directly before an I/O thread is started, so that
+ * small streams are processed without threads. */
+#define PIPELINE_MIN  (4*RING_SIZE)
+
+/* Number of characters at the start of a segment which may be re-encoded
+ * to join it to the previous segment: a few tens on average, and rarely
+ * more than a few hundreds, see encrypt_batch(). */
+#define SEGMENT_MARKS  1024
+
+/* Number of sequences decoded past the end of a segment to find a boundary
+ * shared with the next segment. */
+#define SYNC_SEQUENCES  256
+
+/* Number of plaintext characters in a frame of framed ciphertext. */
+#define FRAME_SIZE  4096
+
+/* An input stream: a memory-mapped regular file or a buffered stream. */
+struct input {
+    FILE *file;
+    char *data;     /* [start;end[ contains not yet used characters */
+    size_t start;
+    size_t end;
+    size_t size;    /* size of the buffer of a stream */
+    int escape;     /* true to escape the bytes read */
+    int compress;   /* true to compress the characters read */
+    int held;       /* characters read but not compressed yet */
+    int space;      /* true after spaces, see squeeze_spaces() */
+    char hold[TOKEN_MAX];
+    int last;       /* true if there is nothing more to read */
+    void *map;      /* mapped file or 0 */
+    struct filter *filter;
+    struct ring *reader;    /* reader thread of the stream or 0 */
+    int ahead;      /* true to start a reader thread after PIPELINE_MIN */
+    size_t count;   /* bytes read from the stream without thread */
+    char chunk[CHUNK_SIZE];
+};
 
-    for (i = 0; i < 25; i++)
-        if (Code_mat[i] == a)
-            break;
-    for (j = 0; j < 8; j++)
-        if (Code_mat[knightjumps[i][j]] == b)
-            return 0;
-    return 1;
-}
+/* A ring of buffers passing a stream between the cipher thread and an I/O
+ * thread, which reads the stream ahead or writes it behind. Buffers
+ * [TAIL;HEAD[ (modulo RING_SLOTS) are filled and wait for the consumer.
+ * The producer alone moves HEAD and the consumer TAIL, with ring_store(),
+ * so that a buffer is handed over without a lock; the lock only guards a
+ * thread going to sleep on an empty or full ring. */
+struct ring {
+    FILE *file;
+    int writer;             /* true if the I/O thread writes FILE */
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;    /* signaled when HEAD, TAIL, DONE or ERR changes
+                             * while a thread waits */
+    unsigned long waiting;  /* threads waiting on COND */
+    unsigned long head;
+    unsigned long tail;
+    size_t pos;             /* bytes used in the buffer of the cipher */
+    unsigned long done;     /* true at the end of the stream or on stop */
+    unsigned long err;      /* errno of a failed read or write, or 0 */
+    int detached;           /* true if the thread frees the ring, see
+                             * stop_ring() */
+    int exited;             /* true once the thread is past the ring */
+    size_t size;            /* size of each buffer */
+    size_t len[RING_SLOTS]; /* bytes filled in each buffer */
+    char *data;
+};
+
+#ifndef __GNUC__
+/* Lock ordering the indices of rings, without atomic operations. */
+static pthread_mutex_t ring_sync = PTHREAD_MUTEX_INITIALIZER;
+#endif
+
+/* A segment of input processed by a thread. */
+struct segment {
+    struct handy cipher[1];
+    const char *in;
+    size_t len;
+    char *out;
+    size_t outlen;
+    size_t outsize;
+    int err;
+    pthread_t thread;
+
+    /* Encryption: IN is plaintext starting with a non-space character,
+     * followed by character NEXT or EOF. OUT is unformatted ciphertext. */
+    int next;
+    int nmarks;
+    struct {
+        size_t in;      /* offset of a first character in plaintext */
+        size_t out;     /* offset of its encoding in ciphertext */
+        uint32_t follow; /* follow_mask() before encoding it */
+    } marks[SEGMENT_MARKS];
+
+    /* Decryption: IN is a batch of ciphertext, whose sequences are decoded
+     * from offset FROM. OUT contains the decoded characters, or 0 for errors,
+     * and STARTS the offsets of their sequences. STOP is the offset
+     * following the last sequence. */
+    size_t from;
+    size_t to;
+    size_t limit;
+    size_t stop;
+    uint32_t *starts;
+};
 
-/* Return the column-direction that contains character C or -1 if not found. */
+/* Set the error message of CIPHER and return error code ERR. */
 static int
-get_column(struct handy *cipher, int c)
+set_error(struct handy *cipher, int err, const char *fmt, ...)
 {
-    int i, j;
+    va_list ap;
 
-    for (i = 0; i < 5; i++)
-        for (j = i; j < i + 21; j += 5)
-            if (Code_mat[j] == c)
-                return i;
-    return -1;
+    va_start(ap, fmt);
+    vsnprintf(Errmsg, sizeof(Errmsg), fmt, ap);
+    va_end(ap);
+    return err;
 }
 
 /* Return the code (1-31) of character C or 0 if not found. */
 static int
 get_code(struct handy *cipher, int c)
 {
-    int i;
-
-    for (i = 0; i < sizeof(Subkey); i++)
-        if (c == Subkey[i])
-            return i + 1;
-    fatal(isprint(c) ? "%s -- '%c'" : "%s -- %#04x",
-            "cannot code character", c);
-    return 0;
+    return Code_of[CHR(c)];
 }
 
 /* Return true if CODE (1-31) is a power of 2. */
@@ -174,6 +522,37 @@ shuffle(char *set, int n, struct pcgstate *rnd)
     }
 }
 
+/* Return the number of bits set in MASK. */
+static int
+bit_count(uint32_t mask)
+{
+#ifdef __GNUC__
+    return __builtin_popcount(mask);
+#else
+    int n;
+
+    for (n = 0; mask; n++)
+        mask &= mask - 1;
+    return n;
+#endif
+}
+
+/* Return the index of bit N (0 for the lowest) among the bits set in
+ * MASK. */
+static int
+nth_bit(uint32_t mask, int n)
+{
+    for (; n > 0; n--)
+        mask &= mask - 1;
+#ifdef __GNUC__
+    return __builtin_ctz(mask);
+#else
+    for (n = 0; !(mask & 1); n++)
+        mask >>= 1;
+    return n;
+#endif
+}
+
 /* Trace CIPHER on stdout. */
 static void
 trace_cipher(struct handy *cipher)
@@ -223,14 +602,249 @@ trace_bcode(int code)
     putchar(' ');
 }
 
-/* Initialize a new cipher. */
+/* Index in Perms of the permutations of LEN (0-5) elements, and their
+ * number. */
+static const int perm_base[6] = { 0, 0, 1, 3, 9, 33 };
+static const int factorial[6] = { 1, 1, 2, 6, 24, 120 };
+
+/* Fill the transitions of the decoder, which do not depend on the key:
+ * - null characters and spaces are skipped;
+ * - a first code character is followed by a colinear one giving the
+ *   direction, or ends a sequence of its column;
+ * - following characters of the direction are added, up to 5;
+ * - a character colinear with the last one starts the next sequence;
+ * - any other character is a noise, which cannot follow another noise. */
+static void
+init_decoder(void)
+{
+    int sym, pos, noise, dir, i, d, j;
+    uint16_t *t;
+
+    for (sym = 0; sym < SYMBOLS; sym++)
+        decoder[DEC_START][sym] = sym < 25 ? DEC_FIRST + sym : DEC_START;
+    decoder[DEC_START][SYM_BAD] = DEC_EINPUT;
+    decoder[DEC_START][SYM_END] = DEC_END;
+
+    for (sym = 0; sym < 25; sym++) {
+        t = decoder[DEC_FIRST + sym];
+        for (i = 0; i < 25; i++) {
+            d = pair_dir[sym][i];
+            t[i] = d < 0 ? DEC_END | 1 << ROW(sym) << DEC_BITS
+                : DEC_STATE(2, 0, d, DIR_POS(d, i))
+                  | (1 << DIR_POS(d, sym) | 1 << DIR_POS(d, i)) << DEC_BITS;
+        }
+        t[SYM_NULL] = DEC_FIRST + sym;
+        t[SYM_BAD] = DEC_EINPUT;
+        t[SYM_END] = DEC_END | 1 << ROW(sym) << DEC_BITS;
+    }
+
+    for (pos = 2; pos <= 5; pos++)
+        for (noise = 0; noise < 2; noise++)
+            for (dir = 0; dir < 20; dir++)
+                for (i = 0; i < 5; i++) {
+                    t = decoder[DEC_STATE(pos, noise, dir, i)];
+                    for (sym = 0; sym < 25; sym++) {
+                        j = DIR_POS(dir, sym);
+                        if (dir_slots[dir] >> sym & 1)
+                            t[sym] = pos == 5 ? DEC_ELONG
+                                : DEC_STATE(pos + 1, 0, dir, j)
+                                  | 1 << j << DEC_BITS;
+                        else if (pair_dir[DIR_SLOT(dir, i)][sym] != -1)
+                            t[sym] = DEC_END;
+                        else
+                            t[sym] = noise ? DEC_ENOISE
+                                : DEC_STATE(pos, 1, dir, i);
+                    }
+                    t[SYM_NULL] = DEC_STATE(pos, noise, dir, i);
+                    t[SYM_BAD] = DEC_EINPUT;
+                    t[SYM_END] = DEC_END;
+                }
+}
+
+/* Fill the lookup tables of the tokens of compressed plaintext. */
+static void
+init_tokens(void)
+{
+    int i, k, c;
+
+    memset(token_first, -1, sizeof(token_first));
+    memset(symbol_code, -1, sizeof(symbol_code));
+    for (i = 0; i < TOKENS; i++)
+        token_len[i] = (unsigned char) strlen(tokens[i]);
+    /* Insert the tokens by increasing length, before the shorter ones */
+    for (k = 1; k <= TOKEN_MAX; k++)
+        for (i = 0; i < TOKENS; i++)
+            if (token_len[i] == k) {
+                c = CHR(tokens[i][0]);
+                token_next[i] = token_first[c];
+                token_first[c] = (signed char) i;
+            }
+    for (i = 0; i < sizeof(CODE_SYMBOLS) - 1; i++)
+        symbol_code[CHR(CODE_SYMBOLS[i])] = (signed char) i;
+}
+
+/* Fill the lookup tables of escaped plaintext. */
+static void
+init_escapes(void)
+{
+    int s, k, c, n, codes = sizeof(CODE_SYMBOLS) - 1;
+    char coded[256];
+
+    /* Decoding: the bytes of one symbol, of the escape symbol and one
+     * symbol, then the others */
+    memset(coded, 0, sizeof(coded));
+    memset(esc_next, -1, sizeof(esc_next));
+    for (k = 0; k < codes; k++) {
+        c = CHR(CODE_SYMBOLS[k]);
+        esc_next[0][k] = k == ESC_SYMBOL ? ESC_STATE(1) : c == '^' ? ' ' : c;
+        esc_next[1][k] = k < ESC_SINGLE ? CHR(ESC_CHARS[k])
+                                        : ESC_STATE(k - ESC_SINGLE + 2);
+    }
+    for (s = 0; s < 2; s++)
+        for (k = 0; k < codes; k++)
+            if (esc_next[s][k] < 256)
+                coded[esc_next[s][k]] = 1;
+    for (c = 0, n = 0; c < 256; c++)
+        if (!coded[c] && !(c >= 'a' && c <= 'z')) {
+            esc_next[n / codes + 2][n % codes] = (short) c;
+            n++;
+        }
+
+    /* Encoding: the inverse, lowercase letters as uppercase ones */
+    for (s = 0; s < ESC_STATES; s++)
+        for (k = 0; k < codes; k++) {
+            if ((c = esc_next[s][k]) < 0 || c >= 256)
+                continue;
+            n = 0;
+            if (s > 0)
+                esc_codes[c][n++] = CODE_SYMBOLS[ESC_SYMBOL];
+            if (s > 1)
+                esc_codes[c][n++] = CODE_SYMBOLS[s - 2 + ESC_SINGLE];
+            esc_codes[c][n++] = CODE_SYMBOLS[k];
+            esc_len[c] = (unsigned char) n;
+        }
+    for (c = 'a'; c <= 'z'; c++) {
+        memcpy(esc_codes[c], esc_codes[c - 'a' + 'A'], ESC_MAX);
+        esc_len[c] = esc_len[c - 'a' + 'A'];
+    }
+}
+
+/* Fill the lookup tables of CIPHER from its matrices and subkey. */
 static void
-init_cipher(struct handy *cipher, char *key, int core)
+init_tables(struct handy *cipher)
+{
+    int i, j, len, n, r;
+    char *p;
+
+    memset(Code_of, 0, sizeof(Code_of));
+    memset(Slot_of, -1, sizeof(Slot_of));
+    memset(Is_null, 0, sizeof(Is_null));
+    memset(Sym_of, SYM_BAD, sizeof(Sym_of));
+
+    for (i = 0; i < sizeof(Subkey); i++) {
+        Code_of[CHR(Subkey[i])] = i + 1;
+        for (r = 0, j = 0; j < 5; j++)
+            if ((i + 1) & (1 << j))
+                r |= 16 >> j;
+        Flip[CHR(Subkey[i])] = Subkey[r - 1];
+    }
+    for (i = 0; i < sizeof(Code_mat); i++) {
+        Slot_of[CHR(Code_mat[i])] = i;
+        Sym_of[CHR(Code_mat[i])] = i;
+        Is_null[CHR(Null_mat[i])] = 1;
+        if (!Core)
+            Sym_of[CHR(Null_mat[i])] = SYM_NULL;
+    }
+    for (i = 0; i < sizeof(Sym_of); i++)
+        if (isspace(i))
+            Sym_of[i] = SYM_NULL;
+
+    pthread_once(&decoder_once, init_decoder);
+    pthread_once(&tokens_once, init_tokens);
+    pthread_once(&escapes_once, init_escapes);
+    pthread_once(&sha256_once, sha256_cpu);
+
+    /* Rank the symbols of compressed plaintext by increasing code weight,
+     * in order of CODE_SYMBOLS for the same weight */
+    memset(Sym_rank, -1, sizeof(Sym_rank));
+    for (n = 0, len = 1; len <= 5; len++)
+        for (i = 0; i < sizeof(Rank_sym); i++)
+            if (bit_count(Code_of[CHR(CODE_SYMBOLS[i])]) == len) {
+                Rank_sym[n] = CODE_SYMBOLS[i];
+                Sym_rank[CHR(CODE_SYMBOLS[i])] = (signed char) n++;
+            }
+
+    /* Unrank all permutations of each length.
+     * See 'Ranking and unranking permutations in linear time'
+     * by Wendy Myrvold and Frank Ruskey */
+    for (len = 1, n = 1; len <= 5; n *= ++len) {
+        for (r = 0; r < n; r++) {
+            p = Perms[perm_base[len] + r];
+            for (i = 0; i < len; i++)
+                p[i] = i;
+            for (i = r, j = len; j > 0; j--) {
+                char tmp;
+
+                tmp = p[j - 1];
+                p[j - 1] = p[i % j];
+                p[i % j] = tmp;
+                i /= j;
+            }
+        }
+    }
+}
+
+struct handy *
+handy_new(void)
+{
+    return malloc(sizeof(struct handy));
+}
+
+void
+handy_free(struct handy *cipher)
+{
+    free(cipher);
+}
+
+const char *
+handy_errmsg(struct handy *cipher)
+{
+    return Errmsg;
+}
+
+/* Initialize CIPHER, see handy_init(). The random source is seeded with
+ * SEED (state and sequence) if not null, else with system entropy. */
+static int
+init_cipher(struct handy *cipher, const char *key, int flags,
+            const uint64_t *seed)
 {
+    SHA256_CTX sha[1];
     char *p;
     int c, i, j;
 
-    if (handy_trace) {
+    Core = (flags & HANDY_CORE) != 0;
+    Trace = (flags & HANDY_TRACE) != 0;
+    Framed = (flags & HANDY_FRAMED) != 0;
+    Packed = (flags & HANDY_PACKED) != 0;
+    Compress = (flags & HANDY_COMPRESS) != 0;
+    Escape = (flags & HANDY_ESCAPE) != 0;
+    Mac = (flags & HANDY_MAC) != 0;
+    Threads = 1;
+    Writer = 0;
+    Write_to = 0;
+    handy_set_density(cipher, HANDY_DENSITY);
+    strcpy(Errmsg, "no error");
+
+    if (Framed && (Packed || Compress || Escape || Mac))
+        return set_error(cipher, HANDY_EFORMAT,
+                "framed ciphertext cannot be %s",
+                Packed ? "packed" : Mac ? "authenticated"
+                       : Compress ? "compressed" : "escaped");
+    if (Packed && Mac)
+        return set_error(cipher, HANDY_EFORMAT,
+                "packed ciphertext cannot be authenticated");
+
+    if (Trace) {
         printf("Key: ");
         for (i = 0; i < 51; i++)
             putchar(key[i]);
@@ -238,7 +852,7 @@ init_cipher(struct handy *cipher, char *key, int core)
     }
     memset(Key, 0, sizeof(Key));
     for (i = 0; i < sizeof(Key); i++) {
-        c = key[i];
+        c = CHR(key[i]);
         if (c >= 'A' && c <= 'Y')
             j = c - 'A';
         else if (c >= 'a' && c <= 'y')
@@ -246,10 +860,12 @@ init_cipher(struct handy *cipher, char *key, int core)
         else if (c == '^')
             j = 50;
         else
-            fatal(isprint(c) ? "%s -- '%c'" : "%s -- %#04x",
+            return set_error(cipher, HANDY_EKEY,
+                    isprint(c) ? "%s -- '%c'" : "%s -- %#04x",
                     "invalid character in key", c);
         if (Key[j])
-            fatal("repeated character in key -- '%c'", c);
+            return set_error(cipher, HANDY_EKEY,
+                    "repeated character in key -- '%c'", c);
         Key[j]++;
     }
     memcpy(Key, key, sizeof(Key));
@@ -292,68 +908,289 @@ init_cipher(struct handy *cipher, char *key, int core)
         Subkey[j++] = c;
     }
 
-    if (!pcg_entropy(Random))
-        fatal("cannot initialize random source");
+    init_tables(cipher);
+    sha256_init(sha);
+    sha256_update(sha, (const uint8_t *) "handy mac", 9);
+    sha256_update(sha, (const uint8_t *) Key, sizeof(Key));
+    sha256_final(sha, Mac_key);
+    filter_init(&Filters[FILTER_CIPHERTEXT], FILTER_CIPHERTEXT);
+    filter_init(&Filters[FILTER_PLAINTEXT], FILTER_PLAINTEXT);
+
+    if (seed)
+        pcg_seed(Random->rng, seed[0], seed[1]);
+    else if (!pcg_entropy(Random->rng))
+        return set_error(cipher, HANDY_ERANDOM,
+                "cannot initialize random source");
+    pcg_bitsinit(Random);
+    handy_reset(cipher);
+
+    if (Trace)
+        trace_cipher(cipher);
+    return HANDY_OK;
+}
+
+int
+handy_init(struct handy *cipher, const char *key, int flags)
+{
+    return init_cipher(cipher, key, flags, 0);
+}
+
+int
+handy_init_seeded(struct handy *cipher, const char *key, int flags,
+                  uint64_t state, uint64_t sequence)
+{
+    uint64_t seed[2];
+
+    seed[0] = state;
+    seed[1] = sequence;
+    return init_cipher(cipher, key, flags, seed);
+}
+
+void
+handy_set_threads(struct handy *cipher, int threads)
+{
+    Threads = threads < 1 ? 1 : threads;
+}
+
+void
+handy_set_density(struct handy *cipher, int density)
+{
+    density = density < 0 ? 0 : density > 100 ? 100 : density;
+    Density = (density * 256 + 50) / 100;
+}
 
+void
+handy_reset(struct handy *cipher)
+{
     Prev_code = 0;
     Prev_last = 0;
     Prev_dir = -1;
     Parity = 0;
-    Core = core;
+    Col = 0;
+    Pack_word = 0;
+    Pack_len = -1;
+    Expand = -1;
+    Unescape = -1;
+    sha256_hmac_init(Mac_ctx, Mac_ctx + 1, Mac_key, sizeof(Mac_key));
+    Tag_len = -1;
+    strcpy(Errmsg, "no error");
+}
 
-    if (handy_trace)
-        trace_cipher(cipher);
+struct handy *
+handy_clone(struct handy *cipher)
+{
+    struct handy *clone;
+    uint64_t state, sequence;
+
+    if (!(clone = malloc(sizeof(struct handy))))
+        return 0;
+    memcpy(clone, cipher, sizeof(struct handy));
+    clone->writer = 0;
+    clone->write_to = 0;
+    state = pcg_rand(Random->rng);
+    state = state << 32 | pcg_rand(Random->rng);
+    sequence = pcg_rand(Random->rng);
+    sequence = sequence << 32 | pcg_rand(Random->rng);
+    pcg_seed(clone->random->rng, state, sequence);
+    pcg_bitsinit(clone->random);
+    handy_reset(clone);
+    return clone;
 }
 
-/* Fill BUFFER of size CHUNK_SIZE with next chunk of characters from stream IN.
- * The [START;END[ interval contains not yet used characters and is moved to
- * the beginning of BUFFER.
- * Filter spaces, update END and return true if it was the last chunk. */
-static int
-readchunk(FILE *in, char *buffer, int start, int *end)
+/* Write to OUT the 8 bytes of WORD, in little-endian order. */
+static void
+put_word(char *out, uint64_t word)
+{
+    int i;
+
+    for (i = 0; i < 8; i++, word >>= 8)
+        out[i] = (char) (word & 0xff);
+}
+
+/* Return the word of the 8 bytes of IN, in little-endian order. */
+static uint64_t
+get_word(const char *in)
+{
+    uint64_t word = 0;
+    int i;
+
+    for (i = 7; i >= 0; i--)
+        word = word << 8 | CHR(in[i]);
+    return word;
+}
+
+/* Pack LEN characters of BUFFER to OUT, after the header if it was not
+ * written yet. Letters are written by words of PACKED_LETTERS.
+ * Return the number of bytes written. */
+static size_t
+pack_output(struct handy *cipher, char *out, const char *buffer, int len)
 {
-    int i, n, last = 0;
+    size_t l = 0;
+    int i, c;
 
-    if (start) {
-        for (i = 0; i < *end - start; i++)
-            buffer[i] = buffer[start + i];
-        start = i;
+    if (Pack_len < 0) {
+        memcpy(out, PACKED_HEADER, PACKED_HEADER_LEN);
+        l = PACKED_HEADER_LEN;
+        Pack_len = 0;
     }
-    n = fread(buffer + start, 1, CHUNK_SIZE - start, in);
-    if (n != CHUNK_SIZE - start) {
-        if (ferror(in))
-            fatal("cannot read input -- %s", strerror(errno));
-        last = 1;
+    for (i = 0; i < len; i++) {
+        c = CHR(buffer[i]);
+        Pack_word = Pack_word * 50 + (c <= 'Y' ? c - 'A' : c - 'a' + 25);
+        if (++Pack_len == PACKED_LETTERS) {
+            put_word(out + l, Pack_word);
+            l += 8;
+            Pack_word = 0;
+            Pack_len = 0;
+        }
     }
-    *end = start + n;
-    for (n = start, i = start; i < *end; i++)
-        if (!isspace(buffer[i])) {
-            if (n < i)
-                buffer[n] = buffer[i];
-            n++;
+    return l;
+}
+
+/* Write LEN characters of BUFFER to OUT.
+ * Characters are grouped by 5, with 12 groups by line.
+ * Return the number of bytes written. */
+static size_t
+foutput(struct handy *cipher, char *out, const char *buffer, int len)
+{
+    size_t l = 0;
+    int n;
+
+    if (Packed)
+        return pack_output(cipher, out, buffer, len);
+    if (Mac)
+        sha256_update(Mac_ctx, (const uint8_t *) buffer, len);
+    while (len > 0) {
+        if (Col == 60) {
+            out[l++] = '\n';
+            Col = 0;
         }
-    *end = start + n;
-    return last;
+        n = 5 - Col % 5;
+        if (n > len)
+            n = len;
+        memcpy(out + l, buffer, n);
+        l += n;
+        Col += n;
+        buffer += n;
+        len -= n;
+        if (Col % 5 == 0)
+            out[l++] = ' ';
+    }
+    return l;
 }
 
-/* Write LEN characters of BUFFER to stream FILE.
- * Characters are grouped by 5, with 12 groups by line. */
-static void
-foutput(char *buffer, int len, FILE *file)
+/* Write to OUT the MAC trailer line of the ciphertext, of MAC_LINE bytes:
+ * the HMAC-SHA256 of its non-space characters, keyed with a hash of the
+ * cipher key. Return its length. */
+static size_t
+mac_trailer(struct handy *cipher, char *out)
 {
-    static int n = 0; /* number of non-space chars in current line */
+    static const char *hex = "0123456789abcdef";
+    uint8_t mac[32];
     int i;
 
-    for (i = 0; i < len; i++) {
-        if (n == 60) {
-            putc('\n', file);
-            n = 0;
+    sha256_hmac_final(Mac_ctx, Mac_ctx + 1, mac);
+    memcpy(out, "Zmac ", 5);
+    for (i = 0; i < 32; i++) {
+        out[5 + 2*i] = hex[mac[i] >> 4];
+        out[6 + 2*i] = hex[mac[i] & 15];
+    }
+    out[MAC_LINE - 1] = '\n';
+    return MAC_LINE;
+}
+
+/* Write to OUT the end of the ciphertext: the last word of packed
+ * ciphertext, or a final newline and the MAC trailer.
+ * Return its length, at most 1 + MAC_LINE. */
+static size_t
+end_output(struct handy *cipher, char *out)
+{
+    size_t l;
+
+    if (Packed) {
+        l = pack_output(cipher, out, 0, 0);
+        put_word(out + l, PACKED_FULL + Pack_len * PACKED_TENTH + Pack_word);
+        return l + 8;
+    }
+    out[0] = '\n'; /* ensure final '\n' */
+    return Mac ? 1 + mac_trailer(cipher, out + 1) : 1;
+}
+
+/* Add the non-space characters of the LEN bytes of IN to the MAC, if it
+ * is checked. */
+static void
+mac_update(struct handy *cipher, const char *in, size_t len)
+{
+    char buffer[4096];
+    size_t l, n, bad;
+
+    if (!Mac)
+        return;
+    for (; len > 0; in += l, len -= l) {
+        l = len < sizeof(buffer) ? len : sizeof(buffer);
+        memcpy(buffer, in, l);
+        n = filter_spaces(&Filters[FILTER_CIPHERTEXT], buffer, l, &bad);
+        sha256_update(Mac_ctx, (const uint8_t *) buffer, n);
+    }
+}
+
+/* Read the MAC trailer of the ciphertext in the *INLEN bytes of IN, and
+ * check it at the end of the message (LAST). Set *INLEN to the number of
+ * bytes used. Return an error code. */
+static int
+read_trailer(struct handy *cipher, const char *in, size_t *inlen, int last)
+{
+    uint8_t mac[32];
+    size_t i;
+    int c, k;
+
+    for (i = 0; i < *inlen; i++) {
+        c = CHR(in[i]);
+        if (isspace(c))
+            continue;
+        if (Tag_len < 4 ? c != "Zmac"[Tag_len] : Tag_len >= 68 || !isxdigit(c))
+            return set_error(cipher, HANDY_EFORMAT, "invalid MAC trailer");
+        if (Tag_len >= 4) {
+            k = Tag_len - 4;
+            c = isdigit(c) ? c - '0' : tolower(c) - 'a' + 10;
+            Tag[k / 2] = k & 1 ? Tag[k / 2] | c : c << 4;
         }
-        putc(buffer[i], file);
-        n++;
-        if (n % 5 == 0)
-            putc(' ', file);
+        Tag_len++;
     }
+    *inlen = i;
+    if (!last)
+        return HANDY_OK;
+    if (Tag_len < 68)
+        return set_error(cipher, HANDY_EFORMAT, "truncated MAC trailer");
+    if (!Mac)
+        return HANDY_OK; /* not checked */
+    sha256_hmac_final(Mac_ctx, Mac_ctx + 1, mac);
+    if (memcmp(mac, Tag, sizeof(mac)))
+        return set_error(cipher, HANDY_EMAC,
+                "ciphertext authentication failed");
+    return HANDY_OK;
+}
+
+/* Return the set of slots (a 25-bit mask) of the code characters which may
+ * start an encoded character following the last encoded character. */
+static uint32_t
+follow_mask(struct handy *cipher)
+{
+    int slot;
+
+    if (Prev_dir < 0) /* no constraint on the first character */
+        return ALL_SLOTS;
+    /* Not on the previous direction, and colinear with the last character
+     * unless the previous code was a power of 2 */
+    slot = Slot_of[CHR(Prev_last)];
+    return ~dir_slots[Prev_dir] & ALL_SLOTS
+        & (pow2(Prev_code) ? ~line_slots[slot] : line_slots[slot]);
+}
+
+/* Return true with a probability of Density / 256. */
+static int
+chance(struct handy *cipher)
+{
+    return pcg_getbits(Random, 8) < (uint32_t) Density;
 }
 
 /* Fill RESULT by salting LEN characters of BUFFER with null characters.
@@ -364,18 +1201,12 @@ set_salt(struct handy *cipher, char *result, char *buf, int len)
     int i, l;
 
     for (i = 0, l = 0; i < len; i++) {
-        while (pcg_boundedrand(Random, 2)
-                && l < MAX_ENCODED_LEN - len + i)
-            result[l++] = Null_mat[pcg_boundedrand(Random, 25)];
+        while (l < MAX_ENCODED_LEN - len + i && chance(cipher))
+            result[l++] = Null_mat[pcg_smallrand(Random, 25)];
         result[l++] = buf[i];
     }
-    if (i < len) {
-        warning("salt buffer full -- randomizer may lack uniformity");
-        for (; i < len; i++)
-            result[l++] = buf[i];
-    }
 
-    if (handy_trace)
+    if (Trace)
         for (i = 0; i < l; i++)
             putchar(result[i]);
     return l;
@@ -391,15 +1222,13 @@ set_noise(struct handy *cipher, char *result, char *buf, int len)
     result[0] = buf[0];
     for (i = 1, l = 1; i < len; i++) {
         result[l++] = buf[i];
-        if (pcg_boundedrand(Random, 2)) {
-            for (j = 0; j < sizeof(Code_mat); j++)
-                if (Code_mat[j] == buf[i])
-                    break;
-            k = (int) pcg_boundedrand(Random, 8);
+        if (chance(cipher)) {
+            j = Slot_of[CHR(buf[i])];
+            k = (int) pcg_getbits(Random, 3);
             result[l++] = Code_mat[knightjumps[j][k]];
         }
     }
-    if (handy_trace) {
+    if (Trace) {
         for (i = 0; i < l; i++)
             putchar(result[i]);
         for (; i < 10; i++)
@@ -410,75 +1239,52 @@ set_noise(struct handy *cipher, char *result, char *buf, int len)
 
 /* Encode the character C of code CODE in buffer RESULT.
  * NEXT_CODE is the code of the character following C or 0.
- * Return the length of the result (<= MAX_ENCODED_LEN). */
+ * Return the length of the result (<= MAX_ENCODED_LEN) or an error code. */
 static int
 encode_char(struct handy *cipher, int c, int code, int next_code, char *result)
 {
-    static char lines[20] = { 0,  1,  2,  3,  4,  5,  6,  7,  8,  9,
-                             10, 11, 12, 13, 14, 15, 16, 17, 18, 19 };
-    char ranks[120], r;
-
-    int dir, len, i, j, k, l;
-    char raw[5], permuted[5];
+    int dir, len, i, first;
+    uint32_t dirs, follow, valid, slots;
+    char permuted[5], *p;
 
-    if (handy_trace)
+    if (Trace)
         trace_bcode(code);
 
     Parity = 1 - Parity;
 
-    /* DIR loops on all directions in random order */
-    shuffle(lines, 20, Random);
-    for (i = 0; i < sizeof(lines); i++) {
-        dir = lines[i];
-        if ((pow2(code) && dir >= 5)
-            ||
-            (dir >= 5 && dir < 10
-             &&
-             ((!Parity && next_code == 1 << (9 - dir))
-              ||
-              (Parity && next_code == 1 << (dir - 5)))))
-            continue;
-
-        /* Encode one input character into 1 to 5 characters */
-        for (j = 0, len = 0, r = 1; j < sizeof(raw); j++)
-            if (code & (1 << (4 - j))) {
-                raw[len++] = Code_mat[directions[dir][Parity ? j : 4 - j]];
-                r *= len;
-            }
-
-        /* J loops on all r = len! permutation ranks in random order.
-         * See 'Ranking and unranking permutations in linear time'
-         * by Wendy Myrvold and Frank Ruskey */
-        for (j = 0; j < r; j++)
-            ranks[j] = j;
-        shuffle(ranks, r, Random);
-        for (j = 0; j < r; j++) {
-            for (k = 0; k < len; k++)
-                permuted[k] = raw[k];
-            for (k = ranks[j], l = len; l > 0; l--) {
-                char tmp;
-
-                tmp = permuted[l - 1];
-                permuted[l - 1] = permuted[k % l];
-                permuted[k % l] = tmp;
-                k /= l;
-            }
-            /* At this point PERMUTED contains a random transposition of RAW.
-             * We can now check the encoding sequence validity. */
-            if (!Prev_code
-                ||
-                (!has_direction(cipher, permuted[0], Prev_dir)
-                 &&
-                 (colinear(cipher, permuted[0], Prev_last) ?
-                    !pow2(Prev_code) : pow2(Prev_code))))
-                goto found;
-        }
-    }
-    /* Not reached */
-    fatal("no encoding direction found -- this should not happen!");
-
-found:
-    if (handy_trace) {
+    /* Directions encoding CODE: columns only for a power of 2, and not the
+     * row which would be read as a hyphen before NEXT_CODE */
+    dirs = pow2(code) ? 0x1f : 0xfffff;
+    for (dir = 5; dir < 10; dir++)
+        if (next_code == 1 << (Parity ? dir - 5 : 9 - dir))
+            dirs &= ~((uint32_t) 1 << dir);
+
+    /* Keep those where a character can follow the previous encoding */
+    follow = follow_mask(cipher);
+    for (valid = 0, dir = 0; dir < 20; dir++)
+        valid |= (uint32_t) ((candidates[code][Parity][dir] & follow) != 0)
+                 << dir;
+    valid &= dirs;
+    if (!valid)
+        return set_error(cipher, HANDY_EINTERNAL,
+                "no encoding direction found -- this should not happen!");
+
+    /* Draw a direction, then a permutation of its characters starting with
+     * one that can follow: every valid permutation of the chosen direction
+     * is equally likely. */
+    dir = nth_bit(valid, (int) pcg_smallrand(Random, bit_count(valid)));
+    slots = candidates[code][Parity][dir];
+    len = bit_count(slots);
+    first = nth_bit(slots & follow,
+                    (int) pcg_smallrand(Random, bit_count(slots & follow)));
+    permuted[0] = Code_mat[first];
+    slots &= ~((uint32_t) 1 << first);
+    p = Perms[perm_base[len - 1]
+              + pcg_smallrand(Random, factorial[len - 1])];
+    for (i = 1; i < len; i++)
+        permuted[i] = Code_mat[nth_bit(slots, p[i - 1])];
+
+    if (Trace) {
         trace_direction(dir);
         for (i = 0; i < len; i++)
             putchar(permuted[i]);
@@ -491,7 +1297,7 @@ found:
     Prev_last = permuted[len - 1];
 
     /* Add noises and nulls characters. */
-    if (Core)
+    if (Core || !Density)
         len = set_noise(cipher, result, permuted, len);
     else {
         char noise[9];
@@ -500,7 +1306,7 @@ found:
         len = set_salt(cipher, result, noise, len);
     }
 
-    if (handy_trace)
+    if (Trace)
         putchar('\n');
     return len;
 }
@@ -508,7 +1314,7 @@ found:
 /* Encode the character C in buffer RESULT into at most 2*MAX_ENCODED_LEN
  * characters. NEXT is the character following C or EOF.
  * If hyphenation is required, encode the two characters '-' and C.
- * Return the length of the result. */
+ * Return the length of the result or an error code. */
 static int
 encode(struct handy *cipher, int c, int next, char *result)
 {
@@ -521,158 +1327,162 @@ encode(struct handy *cipher, int c, int next, char *result)
         next_code = code;
         code = get_code(cipher, '-');
         if (Prev_code * code == 16)
-            fatal("cannot hyphenate character -- %c", c);
-        if (handy_trace)
+            return set_error(cipher, HANDY_ECODE,
+                    "cannot hyphenate character -- %c", c);
+        if (Trace)
             printf("!- %2d ", code);
         len = encode_char(cipher, '-', code, next_code, result);
+        if (len < 0)
+            return len;
         code = next_code;
     }
 
-    if (handy_trace)
+    if (Trace)
         printf(" %c %2d ", c, code);
     next_code = next == EOF ? 0 : get_code(cipher, next);
-    len += encode_char(cipher, c, code, next_code, result + len);
-    return len;
+    code = encode_char(cipher, c, code, next_code, result + len);
+    return code < 0 ? code : len + code;
 }
 
-/* Output to stream TO a formatted encryption of stream FROM.
- * The CORE flag is set for core encryption algorithm only.
- * The TRACE flag traces the encoding process on stdout. */
-void
-handy_encrypt(FILE *from, FILE *to, char *key, int core, int trace)
+/* Encrypt input IN into OUT, see handy.h. LAST is true if IN ends the
+ * message. */
+static int
+encrypt_input(struct handy *cipher, const char *in, size_t *inlen,
+              char *out, size_t *outlen, int last)
 {
-    int current, next, len;
+    size_t i, j = 0, n, len, end, room;
+    int l, err;
     char result[2*MAX_ENCODED_LEN];
-    struct handy cipher[1];
-
-    int start = 0, end = 0, last = 0;
-    char input[CHUNK_SIZE];
-
-    handy_trace = trace;
-    init_cipher(cipher, key, core);
-
-    for (;;) {
-        /* Fill input buffer with at least 2 characters */
-        while (!last && end - start < 2) {
-            last = readchunk(from, input, start, &end);
-            start = 0;
-        }
 
-        /* Are we done? */
-        if (end - start == 0)
+    /* Process at most a chunk by call, unless it makes no progress */
+    len = *inlen;
+    if (len > CHUNK_SIZE) {
+        len = CHUNK_SIZE;
+        last = 0;
+    }
+    /* Keep room for the end of the ciphertext */
+    room = MAX_FORMATTED_LEN
+           + (!last ? 0 : Packed ? PACKED_END : 1 + (Mac ? MAC_LINE : 0));
+
+again:
+    i = 0;
+    n = 0;
+    err = HANDY_OK;
+    end = filter_check(&Filters[FILTER_PLAINTEXT], in, len);
+
+    while (i < end && isspace(CHR(in[i])))
+        i++;
+    while (i < end) {
+        /* Look ahead for next character */
+        for (j = i + 1; j < end && isspace(CHR(in[j])); j++)
+            ;
+        if ((j == len && !last) || *outlen - n < room)
             break;
+        if (j == end && end < len)
+            break; /* next character is invalid */
 
-        current = input[start++];
-        next = end - start == 0 ? EOF : input[start];
-
-        len = encode(cipher, current, next, result);
-
-        if (to != stdout || !handy_trace) /* do not mix trace and output */
-            foutput(result, len, to);
+        l = encode(cipher, in[i], j < len ? in[j] : EOF, result);
+        if (l < 0) {
+            err = l;
+            break;
+        }
+        n += foutput(cipher, out + n, result, l);
+        i = j;
     }
 
-    if (to != stdout || !handy_trace)
-        putc('\n', to); /* ensure final '\n' */
+    if (!i && !n && len < *inlen) {
+        len = *inlen;
+        goto again;
+    }
+    if (!err && end < len && (i == end || j == end))
+        err = set_error(cipher, HANDY_ECODE,
+                isprint(CHR(in[end])) ? "%s -- '%c'" : "%s -- %#04x",
+                "cannot code character", CHR(in[end]));
+    if (!err && last && i == len && *outlen - n >= room - MAX_FORMATTED_LEN)
+        n += end_output(cipher, out + n);
+
+    *inlen = i;
+    *outlen = n;
+    return err;
 }
 
-/* Return true if character C is a null character. Abort if it is invalid. */
-static int
-is_salt(struct handy *cipher, int c)
+int
+handy_encrypt_update(struct handy *cipher, const char *in, size_t *inlen,
+                     char *out, size_t *outlen)
 {
-    int i;
+    return encrypt_input(cipher, in, inlen, out, outlen, 0);
+}
 
-    for (i = 0; i < sizeof(Null_mat); i++)
-        if (c == Null_mat[i])
-            break;
-    if (i == sizeof(Null_mat)) {
-        if (Core || ((c < 'A' || c > 'Y') && (c < 'a' || c > 'y')))
-            fatal(isprint(c) ? "%s -- '%c'" : "%s -- %#04x",
-                    "invalid input character", c);
-        else
-            return 0;
-    }
-    return 1;
+int
+handy_encrypt_final(struct handy *cipher, const char *in, size_t *inlen,
+                    char *out, size_t *outlen)
+{
+    return encrypt_input(cipher, in, inlen, out, outlen, 1);
 }
 
 /* Decode in RESULT one character from a BUFFER of LEN characters.
  * RESULT is set to 0 if all characters were nulls.
- * Return the number of used characters in buffer (<= MAX_ENCODED_LEN). */
+ * Return the number of used characters in buffer or an error code. */
 static int
-decode(struct handy *cipher, char *buffer, int len, int *result)
+decode(struct handy *cipher, const char *buffer, int len, int *result)
 {
-    int i, j, used, code, pos, dir, noise;
-    char raw[5];
+    int i, j, used, state, next, bits, code, dir;
+    unsigned t;
 
     *result = 0;
-    for (pos = 0, used = 0; used < len; used++) {
-        code = buffer[used];
-        if (is_salt(cipher, code))
-            continue;
-        switch (pos) {
-        case 0:
-            raw[pos++] = code;
-            break;
-        case 1:
-            dir = get_direction(cipher, code, raw[0]);
-            if (dir < 0) {
-                dir = get_column(cipher, raw[0]);
-                goto end_sequence;
-            }
-            raw[pos++] = code;
-            noise = 0;
-            break;
-        case 2:
-        case 3:
-            if (has_direction(cipher, code, dir)) {
-                raw[pos++] = code;
-                noise = 0;
-            }
-            else {
-                if (colinear(cipher, raw[pos - 1], code))
-                    goto end_sequence;
-                else if (noise)
-                    fatal("invalid sequence -- bad noise in position %d", pos);
-                else
-                    noise = 1;
-            }
+    state = DEC_START;
+    next = DEC_END;
+    bits = 0;
+    for (used = 0; used < len; used++) {
+        t = decoder[state][(int) Sym_of[CHR(buffer[used])]];
+        bits |= t >> DEC_BITS;
+        if ((next = t & DEC_NEXT) >= DEC_STATES)
             break;
-        case 4:
-            if (has_direction(cipher, code, dir))
-                fatal("invalid sequence -- too many characters");
-            if (colinear(cipher, raw[pos - 1], code))
-                goto end_sequence;
-            if (noise)
-                fatal("invalid sequence -- bad noise in position 4");
-            else
-                noise = 1;
-            break;
-        }
+        state = next;
+    }
+    if (used == len) {
+        t = decoder[state][SYM_END];
+        bits |= t >> DEC_BITS;
+        next = t & DEC_NEXT;
     }
-    if (!pos) /* only null characters */
+
+    switch (next) {
+    case DEC_EINPUT:
+        return set_error(cipher, HANDY_EINPUT,
+                isprint(CHR(buffer[used])) ? "%s -- '%c'" : "%s -- %#04x",
+                "invalid input character", CHR(buffer[used]));
+    case DEC_ENOISE:
+        return set_error(cipher, HANDY_ESEQUENCE,
+                "invalid sequence -- bad noise in position %d",
+                DEC_POS(state));
+    case DEC_ELONG:
+        return set_error(cipher, HANDY_ESEQUENCE,
+                "invalid sequence -- too many characters");
+    }
+    if (state == DEC_START) /* only null characters */
         return used;
-    if (pos == 1) /* only one non null character */
-        dir = get_column(cipher, raw[0]);
 
-end_sequence:
     Parity = 1 - Parity;
-    for (code = 0, i = 0; i < 5; i++)
-        for (j = 0; j < pos; j++)
-            if (Code_mat[directions[dir][i]] == raw[j]) {
-                if (Parity)
-                    code |= 16 >> i;
-                else
-                    code |= 1 << i;
-            }
+    code = Parity ? reverse5[bits] : bits;
     *result = Subkey[code - 1];
 
-    if (handy_trace) {
-        for (i = 0; i < used; i++)
-            putchar(buffer[i]);
-        for (i = 0; i < MAX_ENCODED_LEN + 1 - used; i++)
+    if (Trace) {
+        dir = state < DEC_STATE(2, 0, 0, 0) ? (state - DEC_FIRST) % 5
+                                            : DEC_DIR(state);
+        for (i = 0, j = 0; i < used; i++)
+            if (!isspace(CHR(buffer[i]))) {
+                putchar(buffer[i]);
+                j++;
+            }
+        for (; j < MAX_ENCODED_LEN + 1; j++)
             putchar(' ');
-        for (i = 0; i < pos; i++)
-            putchar(raw[i]);
-        for (; i < sizeof(raw) + 1; i++)
+        for (i = 0, j = 0; i < used; i++)
+            if (Slot_of[CHR(buffer[i])] >= 0
+                && dir_slots[dir] >> Slot_of[CHR(buffer[i])] & 1) {
+                putchar(buffer[i]);
+                j++;
+            }
+        for (; j < 6; j++)
             putchar(' ');
         trace_direction(dir);
         trace_bcode(code);
@@ -681,60 +1491,1858 @@ end_sequence:
     return used;
 }
 
-/* Output to stream TO a decryption of stream FROM.
- * The CORE flag is set for core decryption algorithm only.
- * The TRACE flag traces the decoding process on stdout. */
-void
-handy_decrypt(FILE *from, FILE *to, char *key, int core, int trace)
+/* Decrypt input IN into OUT, see handy.h. LAST is true if IN ends the
+ * message. */
+static int
+decrypt_input(struct handy *cipher, const char *in, size_t *inlen,
+              char *out, size_t *outlen, int last)
 {
-    struct handy cipher[1];
-    int c;
+    size_t i, n, len, end, limit, t;
+    int k, c, used, stop, err;
 
-    char input[CHUNK_SIZE];
-    int start = 0, end = 0, last = 0;
+    if (Tag_len >= 0) {
+        *outlen = 0;
+        return read_trailer(cipher, in, inlen, last);
+    }
 
-    handy_trace = trace;
-    init_cipher(cipher, key, core);
+    /* Process at most a chunk by call, unless it makes no progress */
+    len = *inlen;
+    if (len > CHUNK_SIZE) {
+        len = CHUNK_SIZE;
+        last = 0;
+    }
 
-    for (;;) {
-        /* Fill input buffer with at least 2 sequences if possible */
-        while (!last && end - start < 2*MAX_ENCODED_LEN) {
-            last = readchunk(from, input, start, &end);
-            start = 0;
-        }
+again:
+    i = 0;
+    n = 0;
+    err = HANDY_OK;
+    end = filter_check(&Filters[FILTER_CIPHERTEXT], in, len);
+    stop = end < len && in[end] == 'Z'; /* MAC trailer */
+
+    /* A sequence can be decoded if it starts before LIMIT: it is followed
+     * by at least 2*MAX_ENCODED_LEN characters, or by the end. */
+    if ((last && end == len) || stop)
+        limit = end;
+    else {
+        for (limit = end, k = 0; limit > 0 && k < 2*MAX_ENCODED_LEN; limit--)
+            if (!isspace(CHR(in[limit - 1])))
+                k++;
+        if (k < 2*MAX_ENCODED_LEN)
+            limit = 0;
+        else
+            limit++;
+    }
 
-        /* Are we done? */
-        if (end - start == 0)
+    for (;;) {
+        while (i < end && isspace(CHR(in[i])))
+            i++;
+        if (i >= limit || n == *outlen)
+            break;
+        used = decode(cipher, in + i,
+                end - i > INT_MAX ? INT_MAX : (int) (end - i), &c);
+        if (used < 0) {
+            err = used;
             break;
+        }
+        if (c)
+            out[n++] = c;
+        i += used;
+    }
 
-        /* Decode next char */
-        start += decode(cipher, input + start, end - start, &c);
-        if (to != stdout || !handy_trace)
-            putc(c, to);
+    if (!i && !n && len < *inlen) {
+        len = *inlen;
+        goto again;
     }
+    if (!err && end < len && i >= limit && !stop)
+        err = set_error(cipher, HANDY_EINPUT,
+                isprint(CHR(in[end])) ? "%s -- '%c'" : "%s -- %#04x",
+                "invalid input character", CHR(in[end]));
+    mac_update(cipher, in, i);
+
+    if (!err && stop && i >= limit) {
+        Tag_len = 0;
+        t = len - end;
+        err = read_trailer(cipher, in + end, &t, last);
+        i = end + t;
+    }
+    else if (!err && last && i == len && Mac)
+        err = set_error(cipher, HANDY_EMAC, "missing MAC trailer");
 
-    if (to == stdout && !handy_trace)
-        putchar('\n'); /* ensure final '\n' on stdout */
+    *inlen = i;
+    *outlen = n;
+    return err;
 }
 
-/* Generate a KEY from a PASSWORD string. */
-void
-handy_keygen(char *password, char *key)
+int
+handy_decrypt_update(struct handy *cipher, const char *in, size_t *inlen,
+                     char *out, size_t *outlen)
 {
-    static const char *keyset =
-        "ABCDEFGHIJKLMNOPQRSTUVWXYabcdefghijklmnopqrstuvwxy^";
+    return decrypt_input(cipher, in, inlen, out, outlen, 0);
+}
 
-    struct pcgstate random[1];
-    uint8_t hash[32];
-    SHA256_CTX sha[1];
+int
+handy_decrypt_final(struct handy *cipher, const char *in, size_t *inlen,
+                    char *out, size_t *outlen)
+{
+    return decrypt_input(cipher, in, inlen, out, outlen, 1);
+}
 
-    sha256_init(sha);
-    sha256_update(sha, (uint8_t *) password, strlen(password));
-    sha256_final(sha, hash);
+/* Return *P, after which the writes made before it was stored by
+ * ring_store() are visible. */
+static unsigned long
+ring_load(unsigned long *p)
+{
+#ifdef __GNUC__
+    return __atomic_load_n(p, __ATOMIC_ACQUIRE);
+#else
+    unsigned long v;
+
+    pthread_mutex_lock(&ring_sync);
+    v = *p;
+    pthread_mutex_unlock(&ring_sync);
+    return v;
+#endif
+}
 
-    pcg_seed(random, *((uint64_t *) hash),
-                     *((uint64_t *) (hash + 8)) & 0x7FFFFFFFFFFFFFFF);
+/* Set *P to V, after the writes made before. */
+static void
+ring_store(unsigned long *p, unsigned long v)
+{
+#ifdef __GNUC__
+    __atomic_store_n(p, v, __ATOMIC_RELEASE);
+#else
+    pthread_mutex_lock(&ring_sync);
+    *p = v;
+    pthread_mutex_unlock(&ring_sync);
+#endif
+}
 
-    memcpy(key, keyset, 51);
-    shuffle(key, 51, random);
+/* Order the stores made before against the loads made after. */
+static void
+ring_fence(void)
+{
+#ifdef __GNUC__
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+#else
+    pthread_mutex_lock(&ring_sync);
+    pthread_mutex_unlock(&ring_sync);
+#endif
+}
+
+/* Wait until *INDEX of ring R is no longer VALUE, or *FLAG is set. The
+ * thread only sleeps if it has to, after counting itself in WAITING, so
+ * that ring_signal() knows to wake it. */
+static void
+ring_wait(struct ring *r, unsigned long *index, unsigned long value,
+          unsigned long *flag)
+{
+    if (ring_load(index) != value || ring_load(flag))
+        return;
+    pthread_mutex_lock(&r->lock);
+    ring_store(&r->waiting, r->waiting + 1);
+    ring_fence();
+    while (ring_load(index) == value && !ring_load(flag))
+        pthread_cond_wait(&r->cond, &r->lock);
+    ring_store(&r->waiting, r->waiting - 1);
+    pthread_mutex_unlock(&r->lock);
+}
+
+/* Wake the thread waiting on ring R, if any, after an index or a flag was
+ * stored. */
+static void
+ring_signal(struct ring *r)
+{
+    ring_fence();
+    if (ring_load(&r->waiting)) {
+        pthread_mutex_lock(&r->lock);
+        pthread_cond_broadcast(&r->cond);
+        pthread_mutex_unlock(&r->lock);
+    }
+}
+
+/* Free ring R, whose thread is done. */
+static void
+free_ring(struct ring *r)
+{
+    pthread_cond_destroy(&r->cond);
+    pthread_mutex_destroy(&r->lock);
+    free(r->data);
+    free(r);
+}
+
+/* Run the I/O thread of ring ARG: fill its buffers from its stream, or
+ * write them to it, until the end of the stream or a stop. */
+static void *
+run_ring(void *arg)
+{
+    struct ring *r = arg;
+    char *buffer;
+    size_t n, len;
+    int err, detached;
+
+    for (;;) {
+        /* The I/O thread moves TAIL of a writer and HEAD of a reader */
+        if (r->writer) {
+            ring_wait(r, &r->head, r->tail, &r->done);
+            if (ring_load(&r->head) == r->tail)
+                break;
+        } else {
+            ring_wait(r, &r->tail, r->head - RING_SLOTS, &r->done);
+
+            /* FILE is locked before a stop returns, or not used again:
+             * the caller may close it once the ring is stopped */
+            pthread_mutex_lock(&r->lock);
+            if (ring_load(&r->done)) {
+                pthread_mutex_unlock(&r->lock);
+                break;
+            }
+            flockfile(r->file);
+            pthread_mutex_unlock(&r->lock);
+        }
+        n = (r->writer ? r->tail : r->head) % RING_SLOTS;
+        buffer = r->data + n * r->size;
+        len = r->writer ? r->len[n] : r->size;
+        err = (int) ring_load(&r->err);
+
+        /* Writes are skipped after an error, for the cipher to stop */
+        if (r->writer && !err && fwrite(buffer, 1, len, r->file) != len)
+            err = errno;
+        if (!r->writer) {
+            if ((len = fread(buffer, 1, len, r->file)) < r->size)
+                err = ferror(r->file) ? errno : 0;
+            funlockfile(r->file);
+        }
+
+        ring_store(&r->err, (unsigned long) err);
+        if (r->writer)
+            ring_store(&r->tail, r->tail + 1);
+        else {
+            r->len[n] = len;
+            ring_store(&r->head, r->head + 1);
+            if (len < r->size)
+                ring_store(&r->done, 1);
+        }
+        ring_signal(r);
+    }
+
+    pthread_mutex_lock(&r->lock);
+    r->exited = 1;
+    detached = r->detached;
+    pthread_mutex_unlock(&r->lock);
+    if (detached)
+        free_ring(r);
+    return 0;
+}
+
+/* Start a thread reading stream FILE ahead, or writing it if WRITER, through
+ * a ring of buffers of SIZE bytes.
+ * Return the ring, or 0 if it cannot be started: FILE is then used
+ * directly. */
+static struct ring *
+start_ring(FILE *file, int writer, size_t size)
+{
+    struct ring *r;
+
+    if (!(r = malloc(sizeof(*r))))
+        return 0;
+    if (!(r->data = malloc(RING_SLOTS * size))) {
+        free(r);
+        return 0;
+    }
+    r->file = file;
+    r->writer = writer;
+    r->waiting = 0;
+    r->head = 0;
+    r->tail = 0;
+    r->pos = 0;
+    r->done = 0;
+    r->err = 0;
+    r->detached = 0;
+    r->exited = 0;
+    r->size = size;
+    pthread_mutex_init(&r->lock, 0);
+    pthread_cond_init(&r->cond, 0);
+    if (pthread_create(&r->thread, 0, run_ring, r)) {
+        pthread_cond_destroy(&r->cond);
+        pthread_mutex_destroy(&r->lock);
+        free(r->data);
+        free(r);
+        return 0;
+    }
+    return r;
+}
+
+/* Stop the thread of ring R, after it wrote the buffers filled if it is a
+ * writer, and free R. A reader may be blocked on its stream, after an error
+ * of the cipher: unless it already exited, it is detached and frees R once
+ * its read returns, so that stopping does not wait for more input.
+ * Return the errno of its last failure, or 0. */
+static int
+stop_ring(struct ring *r)
+{
+    pthread_t thread = r->thread;
+    int err, exited;
+
+    if (r->writer) {
+        if (r->pos) {
+            r->len[r->head % RING_SLOTS] = r->pos;
+            ring_store(&r->head, r->head + 1);
+        }
+        ring_store(&r->done, 1);
+        ring_signal(r);
+        pthread_join(thread, 0);
+        err = (int) ring_load(&r->err);
+        free_ring(r);
+        return err;
+    }
+
+    pthread_mutex_lock(&r->lock);
+    ring_store(&r->done, 1);
+    r->detached = 1;
+    exited = r->exited;
+    err = (int) ring_load(&r->err);
+    pthread_cond_broadcast(&r->cond);
+    pthread_mutex_unlock(&r->lock);
+    if (!exited) {
+        pthread_detach(thread);
+        return err;
+    }
+    pthread_join(thread, 0);
+    free_ring(r);
+    return err;
+}
+
+/* Read at most N bytes from the reader thread of ring R into BUF.
+ * Return the number of bytes read, less than N only at the end of the
+ * stream or on an error. */
+static size_t
+ring_read(struct ring *r, char *buf, size_t n)
+{
+    size_t k, l, len = 0;
+
+    while (len < n) {
+        /* DONE is stored after HEAD, so HEAD is final once DONE is seen */
+        ring_wait(r, &r->head, r->tail, &r->done);
+        if (ring_load(&r->head) == r->tail)
+            break;
+
+        /* The buffer at TAIL is not used by the thread until TAIL moves */
+        k = r->tail % RING_SLOTS;
+        l = r->len[k] - r->pos < n - len ? r->len[k] - r->pos : n - len;
+        memcpy(buf + len, r->data + k * r->size + r->pos, l);
+        len += l;
+        r->pos += l;
+        if (r->pos == r->len[k]) {
+            r->pos = 0;
+            ring_store(&r->tail, r->tail + 1);
+            ring_signal(r);
+        }
+    }
+    return len;
+}
+
+/* Write N bytes of BUF to the writer thread of ring R.
+ * Return the errno of its last failure, or 0. */
+static int
+ring_write(struct ring *r, const char *buf, size_t n)
+{
+    size_t k, l;
+    int err = 0;
+
+    while (n && !err) {
+        if (!r->pos)
+            ring_wait(r, &r->tail, r->head - RING_SLOTS, &r->err);
+        if ((err = (int) ring_load(&r->err)))
+            break;
+
+        /* The buffer at HEAD is not used by the thread until HEAD moves */
+        k = r->head % RING_SLOTS;
+        l = r->size - r->pos < n ? r->size - r->pos : n;
+        memcpy(r->data + k * r->size + r->pos, buf, l);
+        buf += l;
+        n -= l;
+        r->pos += l;
+        if (r->pos == r->size) {
+            r->len[k] = r->size;
+            r->pos = 0;
+            ring_store(&r->head, r->head + 1);
+            ring_signal(r);
+        }
+    }
+    return err;
+}
+
+/* Write N bytes of OUT to stream TO, through the writer thread if it writes
+ * TO. The thread is started once PIPELINE_MIN bytes were written directly.
+ * Return an error code. */
+static int
+write_bytes(struct handy *cipher, FILE *to, const char *out, size_t n)
+{
+    int err;
+
+    if (Write_to == to && (Written += n) > PIPELINE_MIN) {
+        Writer = start_ring(to, 1, RING_SIZE);
+        Write_to = 0;
+    }
+    if (Writer && Writer->file == to) {
+        if ((err = ring_write(Writer, out, n)))
+            return set_error(cipher, HANDY_EIO,
+                    "cannot write output -- %.80s", strerror(err));
+        return HANDY_OK;
+    }
+    if (fwrite(out, 1, n, to) != n)
+        return set_error(cipher, HANDY_EIO,
+                "cannot write output -- %.80s", strerror(errno));
+    return HANDY_OK;
+}
+
+/* Decode the LEN symbols of escaped plaintext IN into OUT, at most LEN
+ * bytes.
+ * Return the length of OUT or an error code. */
+static int
+unescape(struct handy *cipher, const char *in, int len, char *out)
+{
+    int i, k, n = 0;
+
+    for (i = 0; i < len; i++) {
+        k = symbol_code[CHR(in[i])];
+        if (k < 0 || (k = esc_next[Unescape][k]) < 0)
+            return set_error(cipher, HANDY_EFORMAT,
+                    "invalid escaped plaintext");
+        if (k >= ESC_STATE(0))
+            Unescape = k - ESC_STATE(0);
+        else {
+            out[n++] = (char) k;
+            Unescape = 0;
+        }
+    }
+    return n;
+}
+
+/* Write N bytes of OUT to stream TO, expanding compressed plaintext unless
+ * Expand is negative, then decoding escaped plaintext unless Unescape is
+ * negative.
+ * Return an error code. */
+static int
+write_stream(struct handy *cipher, FILE *to, const char *out, size_t n)
+{
+    char buffer[OUTPUT_SIZE];
+    const char *p;
+    size_t i, l = 0;
+    int k, len, err;
+
+    if (Expand < 0 && Unescape < 0)
+        return write_bytes(cipher, to, out, n);
+    for (i = 0; i < n; i++) {
+        if ((k = symbol_code[CHR(out[i])]) < 0)
+            continue; /* hyphen added by the cipher */
+        p = out + i;
+        len = 1;
+        if (Expand >= 0) {
+            k = Sym_rank[CHR(out[i])];
+            if (!Expand && k == ESCAPE) {
+                Expand = 1;
+                continue;
+            }
+            k += Expand ? TOKENS_SINGLE : 0;
+            p = tokens[k];
+            len = token_len[k];
+            Expand = 0;
+        }
+        if (sizeof(buffer) - l < TOKEN_MAX) {
+            if ((err = write_bytes(cipher, to, buffer, l)))
+                return err;
+            l = 0;
+        }
+        if (Unescape < 0)
+            memcpy(buffer + l, p, len);
+        else if ((len = unescape(cipher, p, len, buffer + l)) < 0) {
+            write_bytes(cipher, to, buffer, l); /* output before the error */
+            return len;
+        }
+        l += len;
+    }
+    return write_bytes(cipher, to, buffer, l);
+}
+
+/* Escape the LEN bytes of IN into OUT, at most ESC_MAX times as long. OUT
+ * may overlap IN if it starts at least (ESC_MAX - 1) * LEN bytes before it.
+ * Return the length of OUT. */
+static size_t
+escape(const char *in, size_t len, char *out)
+{
+    size_t i, n = 0;
+    int c;
+
+    for (i = 0; i < len; i++) {
+        c = CHR(in[i]);
+        memcpy(out + n, esc_codes[c], ESC_MAX);
+        n += esc_len[c];
+    }
+    return n;
+}
+
+/* Compress the *INLEN characters of IN into OUT, replacing each longest
+ * token by its code (see tokens), and other characters by themselves: they
+ * are reported by the cipher. OUT may overlap IN if it ends before the
+ * character following the token read. Unless LAST, stop before the last
+ * TOKEN_MAX - 1 characters, which may start a longer token. Set *INLEN to
+ * the number of characters compressed and return the length of OUT, at
+ * most twice as long. */
+static size_t
+compress(struct handy *cipher, const char *in, size_t *inlen, char *out,
+         int last)
+{
+    size_t i, n = 0, len = *inlen;
+    int k, l;
+
+    for (i = 0; i < len && (last || len - i >= TOKEN_MAX); i += l) {
+        for (k = token_first[CHR(in[i])]; k >= 0; k = token_next[k])
+            if ((l = token_len[k]) <= len - i && !memcmp(in + i, tokens[k], l))
+                break;
+        if (k < 0) {
+            out[n++] = in[i];
+            l = 1;
+            continue;
+        }
+        if (k >= TOKENS_SINGLE) {
+            out[n++] = Rank_sym[ESCAPE];
+            k -= TOKENS_SINGLE;
+        }
+        out[n++] = Rank_sym[k];
+    }
+    *inlen = i;
+    return n;
+}
+
+/* Replace in place each run of spaces of the LEN bytes of IN by a '^', for
+ * compression. *SPACE is true if the byte before IN is a space, or if there
+ * is none, and is updated: leading spaces are dropped.
+ * Return the new length. */
+static size_t
+squeeze_spaces(char *in, size_t len, int *space)
+{
+    size_t i, n = 0;
+    int c;
+
+    for (i = 0; i < len; i++) {
+        c = CHR(in[i]);
+        if (!isspace(c))
+            in[n++] = (char) c;
+        else if (!*space)
+            in[n++] = '^';
+        *space = isspace(c) != 0;
+    }
+    return n;
+}
+
+/* Fill the buffer of input IN with next characters from its stream, or
+ * from its reader thread, started once PIPELINE_MIN bytes were read
+ * directly. The [START;END[ interval contains not yet used characters and
+ * is moved to the beginning of the buffer. Spaces are filtered, or
+ * squeezed to '^' if the input is compressed, unless it is escaped.
+ * Return an error code. */
+static int
+readchunk(struct handy *cipher, struct input *in)
+{
+    size_t i, n, m, r, len, bad;
+    int err;
+    char *buffer = in->data;
+
+    for (i = 0; i < in->end - in->start; i++)
+        buffer[i] = buffer[in->start + i];
+    in->start = 0;
+
+    /* Characters to compress are read at the end of the buffer, after
+     * those held back, and compressed in place to I */
+    n = in->size - i;
+    r = i;
+    if (in->compress) {
+        n = n / 2 > in->held ? n / 2 - in->held : 0;
+        r = in->size - n;
+        memcpy(buffer + r - in->held, in->hold, in->held);
+    }
+    /* Bytes to escape are read at the end of [R;R+N[ and escaped in place
+     * to R */
+    m = in->escape ? n / ESC_MAX : n;
+    if (in->ahead && in->count >= PIPELINE_MIN) {
+        in->reader = start_ring(in->file, 0, RING_SIZE);
+        in->ahead = 0;
+    }
+    if (in->reader) {
+        len = ring_read(in->reader, buffer + r + n - m, m);
+        err = (int) ring_load(&in->reader->err);
+    }
+    else {
+        len = fread(buffer + r + n - m, 1, m, in->file);
+        err = ferror(in->file) ? errno : 0;
+        in->count += len;
+    }
+    if (len != m) {
+        if (err)
+            return set_error(cipher, HANDY_EIO,
+                    "cannot read input -- %.80s", strerror(err));
+        in->last = 1;
+    }
+    /* invalid characters are reported by the cipher */
+    if (in->escape)
+        len = escape(buffer + r + n - m, len, buffer + r);
+    else if (in->compress)
+        len = squeeze_spaces(buffer + r, len, &in->space);
+    else if (in->filter)
+        len = filter_spaces(in->filter, buffer + r, len, &bad);
+    if (!in->compress) {
+        in->end = i + len;
+        return HANDY_OK;
+    }
+    r -= in->held;
+    len += in->held;
+    if (in->last && in->space && !in->escape && len)
+        len--; /* trailing spaces */
+    n = len;
+    in->end = i + compress(cipher, buffer + r, &n, buffer + i, in->last);
+    in->held = (int) (len - n);
+    memcpy(in->hold, buffer + r + n, in->held);
+    return HANDY_OK;
+}
+
+/* Initialize input IN from stream FILE, filtered with FILTER if not null,
+ * escaped if ESCAPE and compressed if COMPRESS. A regular file is mapped in
+ * memory and used in place, unless it is escaped or compressed; other
+ * streams are read by chunks. */
+static void
+open_input(struct input *in, FILE *file, struct filter *filter, int escape,
+           int compress)
+{
+    struct stat st;
+
+    in->file = file;
+    in->start = 0;
+    in->end = 0;
+    in->size = CHUNK_SIZE;
+    in->last = 0;
+    in->map = 0;
+    in->filter = filter;
+    in->reader = 0;
+    in->ahead = 0;
+    in->count = 0;
+    in->escape = escape;
+    in->compress = compress;
+    in->held = 0;
+    in->space = 1;
+    in->data = in->chunk;
+
+    if (escape || compress || fstat(fileno(file), &st) || !S_ISREG(st.st_mode)
+        || st.st_size <= 0 || st.st_size != (size_t) st.st_size
+        || ftell(file) != 0)
+        return;
+    in->map = mmap(0, st.st_size, PROT_READ, MAP_PRIVATE, fileno(file), 0);
+    if (in->map == MAP_FAILED) {
+        in->map = 0;
+        return;
+    }
+    posix_madvise(in->map, st.st_size, POSIX_MADV_SEQUENTIAL);
+    in->data = in->map;
+    in->end = st.st_size;
+    in->last = 1;
+}
+
+/* Release the resources of input IN. */
+static void
+close_input(struct input *in)
+{
+    if (in->map)
+        munmap(in->map, in->end);
+    if (in->reader)
+        stop_ring(in->reader);
+}
+
+/* Let a reader thread be started for input IN, unless it is mapped in
+ * memory, and a writer thread for CIPHER on stream TO, once they passed
+ * PIPELINE_MIN bytes. Streams are used directly until then, or if a thread
+ * cannot be started. */
+static void
+start_pipeline(struct handy *cipher, struct input *in, FILE *to)
+{
+    in->ahead = !in->map;
+    Write_to = to;
+    Written = 0;
+}
+
+/* Stop the writer thread of CIPHER, if any, once its output is written.
+ * Return ERR, or an error code if it is HANDY_OK and writing failed. */
+static int
+stop_writer(struct handy *cipher, int err)
+{
+    int k;
+
+    Write_to = 0;
+    if (!Writer)
+        return err;
+    k = stop_ring(Writer);
+    Writer = 0;
+    if (!err && k)
+        err = set_error(cipher, HANDY_EIO,
+                "cannot write output -- %.80s", strerror(k));
+    return err;
+}
+
+/* Cipher function, see handy.h. */
+typedef int (*cipher_fn)(struct handy *, const char *, size_t *,
+                         char *, size_t *);
+
+/* Output to stream TO the result of UPDATE and FINAL on stream FROM, whose
+ * characters are filtered by FILTER. Long streams are read and written by
+ * other threads, while this one runs the cipher. */
+static int
+process(struct handy *cipher, FILE *from, FILE *to, struct filter *filter,
+        cipher_fn update, cipher_fn final)
+{
+    struct input in[1];
+    char out[OUTPUT_SIZE];
+    size_t inlen, outlen;
+    int k, err;
+
+    open_input(in, from, filter,
+               Escape && filter->alphabet == FILTER_PLAINTEXT,
+               Compress && filter->alphabet == FILTER_PLAINTEXT);
+    start_pipeline(cipher, in, to);
+    do {
+        if (!in->last && (err = readchunk(cipher, in)))
+            break;
+        inlen = in->end - in->start;
+        outlen = sizeof(out);
+        err = (in->last ? final : update)(cipher, in->data + in->start,
+                                          &inlen, out, &outlen);
+        in->start += inlen;
+        if (to != stdout || !Trace) { /* do not mix trace and output */
+            k = write_stream(cipher, to, out, outlen);
+            err = err ? err : k;
+        }
+    } while (!err && !(in->last && in->start == in->end));
+    err = stop_writer(cipher, err);
+    close_input(in);
+    return err;
+}
+
+/* Make room for COUNT more output characters in segment S, and for as
+ * many sequence starts if STARTS is true.
+ * Return an error code. */
+static int
+grow_segment(struct segment *s, size_t count, int starts)
+{
+    size_t size;
+    char *out;
+    uint32_t *p;
+
+    if (s->outsize - s->outlen >= count)
+        return HANDY_OK;
+    size = 2*s->outsize + count;
+    if (!(out = realloc(s->out, size)))
+        return set_error(s->cipher, HANDY_EMEMORY, "out of memory");
+    s->out = out;
+    if (starts) {
+        if (!(p = realloc(s->starts, size * sizeof(*p))))
+            return set_error(s->cipher, HANDY_EMEMORY, "out of memory");
+        s->starts = p;
+    }
+    s->outsize = size;
+    return HANDY_OK;
+}
+
+/* Encrypt segment ARG, the start routine of encryption threads. */
+static void *
+encrypt_segment(void *arg)
+{
+    struct segment *s = arg;
+    struct handy *cipher = s->cipher;
+    size_t i, j;
+    int l;
+
+    s->outlen = 0;
+    s->nmarks = 0;
+    s->err = HANDY_OK;
+    for (i = 0; i < s->len; i = j) {
+        for (j = i + 1; j < s->len && isspace(CHR(s->in[j])); j++)
+            ;
+        if ((s->err = grow_segment(s, 2*MAX_ENCODED_LEN, 0)))
+            break;
+        if (s->nmarks < SEGMENT_MARKS) {
+            s->marks[s->nmarks].in = i;
+            s->marks[s->nmarks].out = s->outlen;
+            s->marks[s->nmarks++].follow = follow_mask(cipher);
+        }
+        l = encode(cipher, s->in[i], j < s->len ? s->in[j] : s->next,
+                   s->out + s->outlen);
+        if (l < 0) {
+            s->err = l;
+            break;
+        }
+        s->outlen += l;
+    }
+    return 0;
+}
+
+/* Decode the sequences of segment ARG, the start routine of decryption
+ * threads. Sequences are decoded from FROM, which may be inside a sequence,
+ * until SYNC_SEQUENCES past TO or until LIMIT. */
+static void *
+decrypt_segment(void *arg)
+{
+    struct segment *s = arg;
+    struct handy *cipher = s->cipher;
+    size_t i, past = 0;
+    int used, c;
+
+    s->outlen = 0;
+    s->err = HANDY_OK;
+    for (i = s->from; ; i += used) {
+        while (i < s->len && isspace(CHR(s->in[i])))
+            i++;
+        if (i >= s->limit || (i >= s->to && past++ == SYNC_SEQUENCES))
+            break;
+        if ((s->err = grow_segment(s, 1, 1)))
+            break;
+        used = decode(cipher, s->in + i,
+                s->len - i > INT_MAX ? INT_MAX : (int) (s->len - i), &c);
+        if (used < 0) {
+            /* Mark the error, which is ignored if the segment started on
+             * a wrong boundary, and resynchronize */
+            Parity = 1 - Parity; /* keep entry K decoded with parity K%2 */
+            c = 0;
+            used = 1;
+        }
+        else if (!c)
+            continue; /* only null characters up to the end */
+        s->starts[s->outlen] = (uint32_t) i;
+        s->out[s->outlen++] = c;
+    }
+    s->stop = i;
+    return 0;
+}
+
+/* Run FN on the NSEGS segments of SEGS, on one thread each. */
+static void
+run_segments(struct segment *segs, int nsegs, void *(*fn)(void *))
+{
+    int k;
+
+    for (k = 1; k < nsegs; k++)
+        if (pthread_create(&segs[k].thread, 0, fn, segs + k))
+            segs[k].thread = pthread_self();
+    if (nsegs)
+        fn(segs);
+    for (k = 1; k < nsegs; k++)
+        if (pthread_equal(segs[k].thread, pthread_self()))
+            fn(segs + k); /* no thread was started */
+        else
+            pthread_join(segs[k].thread, 0);
+}
+
+/* Write the content of OUT, filled up to *N, to stream TO.
+ * Return an error code. */
+static int
+flush_output(struct handy *cipher, FILE *to, char *out, size_t *n)
+{
+    int err;
+
+    err = write_stream(cipher, to, out, *n);
+    *n = 0;
+    return err;
+}
+
+/* Format LEN characters of BUFFER into OUT, of OUTPUT_SIZE bytes and filled
+ * up to *N, writing it to stream TO when full.
+ * Return an error code. */
+static int
+write_output(struct handy *cipher, FILE *to, char *out, size_t *n,
+             const char *buffer, size_t len)
+{
+    size_t l;
+    int err;
+
+    for (; len > 0; buffer += l, len -= l) {
+        if (OUTPUT_SIZE - *n < MAX_FORMATTED_LEN + 1
+            && (err = flush_output(cipher, to, out, n)))
+            return err;
+        l = len < 2*MAX_ENCODED_LEN ? len : 2*MAX_ENCODED_LEN;
+        *n += foutput(cipher, out + *n, buffer, (int) l);
+    }
+    return HANDY_OK;
+}
+
+/* Process a batch of input with segments, see encrypt_batch() and
+ * decrypt_batch(). */
+typedef int (*batch_fn)(struct handy *, struct segment *, const char *,
+                        size_t, size_t, int, size_t *, FILE *, char *,
+                        size_t *);
+
+/* Encrypt a batch of AVAIL characters of IN, whose first LEN characters
+ * are valid, into OUT (see write_output()) using Threads segments of SEGS.
+ * LAST is true if IN ends the message. Set *USED to the number of
+ * characters used.
+ *
+ * Each segment is encrypted by a thread from the context of its first
+ * character, except the previous direction and last character which depend
+ * on random choices: the first character is encoded without constraint.
+ * Segments are then joined in order: the first characters of a segment are
+ * encoded again after the previous one, until the thread's encoding of the
+ * next character is valid, which happens after a few characters.
+ * Return an error code. */
+static int
+encrypt_batch(struct handy *cipher, struct segment *segs, const char *in,
+              size_t avail, size_t len, int last, size_t *used,
+              FILE *to, char *out, size_t *n)
+{
+    struct segment *s;
+    struct handy *cur;
+    size_t i, j, end, step;
+    int k, m, l, nsegs, code, prev, parity, next, err = HANDY_OK;
+    uint64_t seed;
+    char result[2*MAX_ENCODED_LEN];
+
+    /* Look ahead for the character following the batch; a stream is
+     * filtered, keep its last character for the next batch */
+    for (i = len; i < avail && isspace(CHR(in[i])); i++)
+        ;
+    if (i < avail)
+        next = in[i];
+    else if (last)
+        next = EOF;
+    else
+        next = in[--len];
+    *used = len;
+
+    /* Split input: the code of the previous character and the parity of
+     * each segment do not depend on random choices */
+    step = len / Threads + 1;
+    prev = Prev_code;
+    parity = Parity;
+    for (nsegs = 0, i = 0; nsegs < Threads; nsegs++) {
+        while (i < len && isspace(CHR(in[i])))
+            i++;
+        if (i == len)
+            break;
+        s = segs + nsegs;
+        memcpy(s->cipher, cipher, sizeof(struct handy));
+        if (nsegs) {
+            s[-1].next = in[i];
+            s->cipher->prev_code = prev;
+            s->cipher->prev_dir = -1;
+            s->cipher->parity = parity;
+        }
+        seed = pcg_rand(Random->rng);
+        seed = seed << 32 | pcg_rand(Random->rng);
+        pcg_seed(s->cipher->random->rng, seed, nsegs);
+        pcg_bitsinit(s->cipher->random);
+        end = nsegs == Threads - 1 || len - i <= step ? len : i + step;
+        s->in = in + i;
+        s->len = end - i;
+        s->next = next;
+        for (; i < end; i++) {
+            if (isspace(CHR(in[i])))
+                continue;
+            code = Code_of[CHR(in[i])];
+            parity ^= prev * code != 16; /* else a hyphen is encoded too */
+            prev = code;
+        }
+    }
+    run_segments(segs, nsegs, encrypt_segment);
+
+    for (cur = cipher, k = 0; k < nsegs && !err; k++) {
+        s = segs + k;
+        if (s->err) {
+            strcpy(Errmsg, s->cipher->errmsg);
+            err = s->err;
+            break;
+        }
+        /* Characters are encoded again from the end of the previous
+         * segment until the segment reached the same state: the code and
+         * parity always match, and the encoding of the next character
+         * only depends on follow_mask(). The segment then continues as
+         * if it had been encoded from there. */
+        for (i = 0, m = 0; i < s->len && !err; i = j, m++) {
+            if (m < s->nmarks && s->marks[m].follow == follow_mask(cur)) {
+                err = write_output(cipher, to, out, n,
+                        s->out + s->marks[m].out,
+                        s->outlen - s->marks[m].out);
+                cur = s->cipher;
+                break;
+            }
+            for (j = i + 1; j < s->len && isspace(CHR(s->in[j])); j++)
+                ;
+            l = encode(cur, s->in[i], j < s->len ? s->in[j] : s->next, result);
+            if (l < 0) {
+                if (cur != cipher)
+                    strcpy(Errmsg, cur->errmsg);
+                err = l;
+                break;
+            }
+            err = write_output(cipher, to, out, n, result, l);
+        }
+    }
+
+    Prev_code = cur->prev_code;
+    Prev_last = cur->prev_last;
+    Prev_dir = cur->prev_dir;
+    Parity = cur->parity;
+    if (!err && last && *used == avail) {
+        if (OUTPUT_SIZE - *n < 1 + MAC_LINE)
+            err = flush_output(cipher, to, out, n);
+        if (!err)
+            *n += end_output(cipher, out + *n);
+    }
+    return err;
+}
+
+/* Decrypt a batch of input into OUT, see encrypt_batch().
+ *
+ * Sequence boundaries do not depend on the parity. Each thread decodes
+ * sequences from an arbitrary offset, with parity 0, and goes on a little
+ * past the start of the next segment. The chain of true boundaries is then
+ * followed from the start of the batch: it goes to the decoded sequences of
+ * the next segment at the first boundary they share, their characters being
+ * flipped to the other parity if needed. Characters are decoded again if no
+ * boundary is shared. Errors are only reported on the chain.
+ * Return an error code. */
+static int
+decrypt_batch(struct handy *cipher, struct segment *segs, const char *in,
+              size_t avail, size_t len, int last, size_t *used,
+              FILE *to, char *out, size_t *n)
+{
+    struct segment *s, *t;
+    size_t i, j, b, limit, step;
+    int k, nsegs, c, l, flip, err = HANDY_OK;
+
+    /* A sequence can be decoded if it starts before LIMIT: it is followed
+     * by at least 2*MAX_ENCODED_LEN characters, or by the end */
+    if (len < avail || last)
+        limit = len;
+    else {
+        for (limit = len, k = 0; limit > 0 && k < 2*MAX_ENCODED_LEN; limit--)
+            if (!isspace(CHR(in[limit - 1])))
+                k++;
+        if (k < 2*MAX_ENCODED_LEN)
+            limit = 0;
+        else
+            limit++;
+    }
+
+    step = limit / Threads + 1;
+    for (nsegs = 0, i = 0; nsegs < Threads && i < limit; nsegs++, i += step) {
+        s = segs + nsegs;
+        memcpy(s->cipher, cipher, sizeof(struct handy));
+        s->cipher->parity = 0;
+        s->in = in;
+        s->len = avail;
+        s->from = i;
+        s->to = nsegs == Threads - 1 || limit - i <= step ? limit : i + step;
+        s->limit = limit;
+    }
+    run_segments(segs, nsegs, decrypt_segment);
+    for (k = 0; k < nsegs; k++)
+        if (segs[k].err) {
+            strcpy(Errmsg, segs[k].cipher->errmsg);
+            return segs[k].err;
+        }
+
+    /* Follow the chain: entry J of segment S, or decode at B if S is null */
+    s = nsegs ? segs : 0;
+    t = segs + 1;
+    flip = Parity;
+    for (b = 0, i = 0, j = 0;; ) {
+        if (s && i < s->outlen)
+            b = s->starts[i];
+        else if (s) {
+            b = s->stop;
+            s = 0;
+        }
+        else
+            while (b < avail && isspace(CHR(in[b])))
+                b++;
+        if (b >= limit)
+            break;
+
+        /* Go to the next segments at a shared boundary */
+        for (; t < segs + nsegs && b >= t->from; t++, j = 0) {
+            while (j < t->outlen && t->starts[j] < b)
+                j++;
+            if (j < t->outlen && t->starts[j] == b) {
+                s = t++;
+                i = j;
+                j = 0;
+                flip = Parity != (int) (i & 1);
+                break;
+            }
+            if (j < t->outlen)
+                break;
+        }
+
+        if (*n == OUTPUT_SIZE && (err = flush_output(cipher, to, out, n)))
+            break;
+        if (s && s->out[i]) {
+            out[(*n)++] = flip ? Flip[CHR(s->out[i])] : s->out[i];
+            Parity = 1 - Parity;
+            i++;
+            continue;
+        }
+        s = 0; /* decode again, to report an error */
+        l = decode(cipher, in + b,
+                avail - b > INT_MAX ? INT_MAX : (int) (avail - b), &c);
+        if (l < 0) {
+            err = l;
+            break;
+        }
+        if (c)
+            out[(*n)++] = c;
+        b += l;
+    }
+    *used = b;
+    return err;
+}
+
+/* Output to stream TO the result of BATCH on stream FROM, whose characters
+ * are filtered by FILTER, on Threads threads. */
+static int
+process_parallel(struct handy *cipher, FILE *from, FILE *to,
+                 struct filter *filter, batch_fn batch)
+{
+    struct input in[1];
+    struct segment *segs;
+    char *buffer = 0, *data, out[OUTPUT_SIZE];
+    size_t size, avail, len, bad, used, t, n = 0;
+    int k, stop, err = HANDY_OK;
+
+    size = (size_t) Threads * SEGMENT_SIZE;
+    open_input(in, from, filter,
+               Escape && filter->alphabet == FILTER_PLAINTEXT,
+               Compress && filter->alphabet == FILTER_PLAINTEXT);
+    if (!in->map) {
+        buffer = malloc(size);
+        in->data = buffer;
+        in->size = size;
+    }
+    segs = calloc(Threads, sizeof(*segs));
+    if (!segs || (!in->map && !buffer))
+        err = set_error(cipher, HANDY_EMEMORY, "out of memory");
+    else
+        start_pipeline(cipher, in, to);
+
+    while (!err) {
+        if (!in->last && (err = readchunk(cipher, in)))
+            break;
+        data = in->data + in->start;
+        avail = in->end - in->start;
+        if (Tag_len >= 0) {
+            err = read_trailer(cipher, data, &avail, in->last);
+            in->start += avail;
+            if (in->last)
+                break;
+            continue;
+        }
+        len = avail < size ? avail : size;
+        bad = filter_check(filter, data, len);
+
+        /* Ciphertext ends at its MAC trailer */
+        stop = filter->alphabet == FILTER_CIPHERTEXT && bad < len
+               && data[bad] == 'Z';
+        if (stop)
+            avail = len = bad;
+        else if (bad == len && len < avail
+                 && filter->alphabet == FILTER_CIPHERTEXT) {
+            /* Sequences starting before LEN are decoded on past it: end
+             * the input at the first character which is not checked or
+             * not valid, such as the 'Z' of a trailer */
+            for (t = len, k = 0; t < avail && k < 2*MAX_ENCODED_LEN; t++)
+                k += !isspace(CHR(data[t]));
+            avail = len + filter_check(filter, data + len, t - len);
+        }
+        else if (bad < len) {
+            err = set_error(cipher,
+                    filter->alphabet == FILTER_PLAINTEXT ?
+                        HANDY_ECODE : HANDY_EINPUT,
+                    isprint(CHR(data[bad])) ? "%s -- '%c'" : "%s -- %#04x",
+                    filter->alphabet == FILTER_PLAINTEXT ?
+                        "cannot code character" : "invalid input character",
+                    CHR(data[bad]));
+            break;
+        }
+        err = batch(cipher, segs, data, avail, len, in->last || stop, &used,
+                    to, out, &n);
+        if (filter->alphabet == FILTER_CIPHERTEXT)
+            mac_update(cipher, data, used);
+        in->start += used;
+        if (!err && stop && used == avail) {
+            Tag_len = 0;
+            t = in->end - in->start;
+            err = read_trailer(cipher, data + used, &t, in->last);
+            in->start += t;
+        }
+        else if (!err && !stop && in->last && in->start == in->end
+                 && filter->alphabet == FILTER_CIPHERTEXT && Mac)
+            err = set_error(cipher, HANDY_EMAC, "missing MAC trailer");
+        if (in->last && in->start == in->end)
+            break;
+    }
+    if (!err)
+        err = flush_output(cipher, to, out, &n);
+    else
+        write_stream(cipher, to, out, n); /* output before the error */
+    err = stop_writer(cipher, err);
+
+    for (k = 0; segs && k < Threads; k++) {
+        free(segs[k].out);
+        free(segs[k].starts);
+    }
+    free(segs);
+    free(buffer);
+    close_input(in);
+    return err;
+}
+
+/* Count in *K the non-space characters of the LEN bytes of IN, up to
+ * FRAME_SIZE, and in *PLEN their number of encoded characters, hyphens
+ * included. *PREV is the code of the previous character.
+ * Return the offset following the last character counted. */
+static size_t
+count_frame(struct handy *cipher, const char *in, size_t len,
+            size_t *k, size_t *plen, int *prev)
+{
+    size_t i;
+    int code;
+
+    for (i = 0; i < len && *k < FRAME_SIZE; i++) {
+        if (isspace(CHR(in[i])))
+            continue;
+        code = Code_of[CHR(in[i])];
+        *plen += 1 + (*prev * code == 16);
+        *prev = code;
+        (*k)++;
+    }
+    return i;
+}
+
+/* Output to stream TO a framed encryption of input IN.
+ *
+ * The ciphertext starts with a header line. Every FRAME_SIZE plaintext
+ * characters, the encoding context is reset and a frame of ciphertext is
+ * written, followed by a blank line. An index follows the frames: lines
+ * with the ciphertext and decrypted lengths of each frame, hyphens added by
+ * the cipher included, and a last line with the offset of the first one.
+ * Lines out of frames start with 'Z', which is not a ciphertext character.
+ * Frames are encrypted in turn: the context is not split between threads. */
+static int
+encrypt_framed(struct handy *cipher, struct input *in, FILE *to)
+{
+    char out[OUTPUT_SIZE];
+    size_t *index = 0, *p, nframes = 0, size = 0;
+    size_t offset, avail, len, inlen, outlen, k = 0, plen = 0, clen = 0, m, q;
+    int prev = 0, last, r, w, err;
+
+    offset = sprintf(out, "Zhandy frames %d\n", FRAME_SIZE);
+    err = write_bytes(cipher, to, out, offset);
+    while (!err) {
+        if (!in->last && (err = readchunk(cipher, in)))
+            break;
+        avail = in->end - in->start;
+
+        /* The current frame ends at LEN if it is in the input */
+        m = k;
+        q = plen;
+        r = prev;
+        len = count_frame(cipher, in->data + in->start, avail, &m, &q, &r);
+        if (!m) { /* only spaces */
+            in->start = in->end;
+            if (in->last)
+                break;
+            continue;
+        }
+        last = m == FRAME_SIZE || in->last;
+        if (!k && !clen) { /* new frame */
+            Prev_code = 0;
+            Prev_last = 0;
+            Prev_dir = -1;
+            Parity = 0;
+            Col = 0;
+        }
+
+        inlen = len;
+        outlen = sizeof(out);
+        err = encrypt_input(cipher, in->data + in->start, &inlen,
+                            out, &outlen, last);
+        count_frame(cipher, in->data + in->start, inlen, &k, &plen, &prev);
+        in->start += inlen;
+        clen += outlen;
+        w = write_bytes(cipher, to, out, outlen);
+        err = err ? err : w;
+        if (err || !last || inlen < len)
+            continue;
+
+        /* End of frame */
+        if ((err = write_bytes(cipher, to, "\n", 1)))
+            break;
+        if (nframes == size) {
+            size = 2*size + 64;
+            if (!(p = realloc(index, 2*size * sizeof(*index)))) {
+                err = set_error(cipher, HANDY_EMEMORY, "out of memory");
+                break;
+            }
+            index = p;
+        }
+        index[2*nframes] = clen + 1;
+        index[2*nframes++ + 1] = plen;
+        offset += clen + 1;
+        k = plen = clen = 0;
+        prev = 0;
+    }
+
+    /* Index lines, of a little more than 60 characters */
+    for (m = 0, len = 0; !err && m < nframes; m++) {
+        if (!len)
+            len = sprintf(out, "Zindex");
+        len += sprintf(out + len, " %lu %lu", (unsigned long) index[2*m],
+                       (unsigned long) index[2*m + 1]);
+        if (len > 60 || m + 1 == nframes) {
+            out[len++] = '\n';
+            err = write_bytes(cipher, to, out, len);
+            len = 0;
+        }
+    }
+    if (!err) {
+        len = sprintf(out, "Zend %lu\n", (unsigned long) offset);
+        err = write_bytes(cipher, to, out, len);
+    }
+    free(index);
+    return err;
+}
+
+/* Decrypt *INLEN characters of IN, which end a frame if LAST, and write to
+ * stream TO the decrypted characters within range [START;END[ of the
+ * decrypted output. *POS is the offset of the first character in it and is
+ * updated.
+ * Set *INLEN to the number of characters used. Return an error code. */
+static int
+decrypt_part(struct handy *cipher, const char *in, size_t *inlen, int last,
+             FILE *to, size_t *pos, size_t start, size_t end)
+{
+    char out[OUTPUT_SIZE];
+    size_t i, l, n, a, b;
+    int w, err = HANDY_OK;
+
+    for (i = 0; !err && i < *inlen; i += l, *pos += n) {
+        l = *inlen - i;
+        n = sizeof(out);
+        err = decrypt_input(cipher, in + i, &l, out, &n, last);
+        if (!l && !n)
+            break; /* more input is needed */
+        a = *pos < start ? start - *pos : 0;
+        b = *pos < end ? end - *pos : 0;
+        a = a < n ? a : n;
+        b = b < n ? b : n;
+        if (a < b && (w = write_bytes(cipher, to, out + a, b - a)) && !err)
+            err = w;
+    }
+    *inlen = i;
+    return err;
+}
+
+/* Parse a decimal number at *I in the LEN bytes of IN, after spaces, and
+ * advance *I. Return -1 if there is none. */
+static long
+parse_number(const char *in, size_t *i, size_t len)
+{
+    long n = -1;
+
+    while (*i < len && in[*i] == ' ')
+        (*i)++;
+    for (; *i < len && in[*i] >= '0' && in[*i] <= '9'; (*i)++)
+        n = (n < 0 ? 0 : 10*n) + (in[*i] - '0');
+    return n;
+}
+
+/* Decrypt the frame of segment ARG, the start routine of frame decryption
+ * threads. IN is a whole frame of LEN characters, and OUT its plaintext. */
+static void *
+decrypt_frame(void *arg)
+{
+    struct segment *s = arg;
+    struct handy *cipher = s->cipher;
+    size_t i, l, n;
+
+    s->outlen = 0;
+    s->err = HANDY_OK;
+    Parity = 0;
+    for (i = 0; i < s->len && !s->err; i += l) {
+        if ((s->err = grow_segment(s, CHUNK_SIZE, 0)))
+            break;
+        l = s->len - i;
+        n = s->outsize - s->outlen;
+        s->err = decrypt_input(cipher, s->in + i, &l, s->out + s->outlen, &n,
+                               1);
+        s->outlen += n;
+        if (!l && !n)
+            break;
+    }
+    return 0;
+}
+
+/* Decrypt the NSEGS frames of SEGS, on one thread each, and write to stream
+ * TO their characters within range [START;END[ of the decrypted output, in
+ * order. The FROM offset of a segment is the one of its first character.
+ * Return an error code. */
+static int
+decrypt_frames(struct handy *cipher, struct segment *segs, int nsegs,
+               FILE *to, size_t start, size_t end)
+{
+    struct segment *s;
+    size_t a, b;
+    int k, err;
+
+    run_segments(segs, nsegs, decrypt_frame);
+    for (k = 0; k < nsegs; k++) {
+        s = segs + k;
+        a = s->from < start ? start - s->from : 0;
+        b = s->from < end ? end - s->from : 0;
+        a = a < s->outlen ? a : s->outlen;
+        b = b < s->outlen ? b : s->outlen;
+        /* output before an error */
+        if (a < b && (err = write_bytes(cipher, to, s->out + a, b - a)))
+            return err;
+        if (s->err) {
+            strcpy(Errmsg, s->cipher->errmsg);
+            return s->err;
+        }
+    }
+    return HANDY_OK;
+}
+
+/* Decrypt the frames of mapped input IN overlapping range [START;END[ of
+ * the decrypted output, found from the index, on Threads threads. DATA is
+ * the offset of the first frame.
+ * Return an error code. */
+static int
+decrypt_index(struct handy *cipher, struct input *in, size_t data, FILE *to,
+              size_t start, size_t end)
+{
+    const char *map = in->data;
+    struct segment *segs, *s;
+    size_t i, e, b, index, offset, pos;
+    long clen, plen;
+    int k, nsegs = 0, threads = Trace ? 1 : Threads, err = HANDY_OK;
+
+    /* The last line gives the offset of the index */
+    for (e = in->end; e > 0 && map[e - 1] == '\n'; e--)
+        ;
+    for (b = e; b > 0 && map[b - 1] != '\n'; b--)
+        ;
+    i = b + 4;
+    if (e - b < 4 || memcmp(map + b, "Zend", 4)
+        || (clen = parse_number(map, &i, e)) < 0 || i != e
+        || (size_t) clen < data || (size_t) clen > b)
+        return set_error(cipher, HANDY_EFORMAT, "invalid index");
+    index = clen;
+    if (!(segs = calloc(threads, sizeof(*segs))))
+        return set_error(cipher, HANDY_EMEMORY, "out of memory");
+
+    /* Frames of the range are decrypted by batches of one per thread */
+    for (offset = data, pos = 0, i = index; i < b && !err; i++) {
+        if (b - i < 6 || memcmp(map + i, "Zindex", 6)) {
+            err = set_error(cipher, HANDY_EFORMAT, "invalid index");
+            break;
+        }
+        for (i += 6; i < b && map[i] != '\n' && !err; pos += plen) {
+            if ((clen = parse_number(map, &i, b)) < 0
+                || (plen = parse_number(map, &i, b)) < 0
+                || (size_t) clen > index - offset) {
+                err = set_error(cipher, HANDY_EFORMAT, "invalid index");
+                break;
+            }
+            if (pos < end && pos + plen > start) {
+                s = segs + nsegs++;
+                memcpy(s->cipher, cipher, sizeof(struct handy));
+                s->in = map + offset;
+                s->len = clen;
+                s->from = pos;
+            }
+            if (nsegs == threads) {
+                err = decrypt_frames(cipher, segs, nsegs, to, start, end);
+                nsegs = 0;
+            }
+            offset += clen;
+        }
+    }
+    if (!err && offset != index)
+        err = set_error(cipher, HANDY_EFORMAT, "invalid index");
+    if (!err)
+        err = decrypt_frames(cipher, segs, nsegs, to, start, end);
+
+    for (k = 0; k < threads; k++)
+        free(segs[k].out);
+    free(segs);
+    return err;
+}
+
+/* Output to stream TO the range [START;END[ of the decryption of framed
+ * input IN, see encrypt_framed(). Frames of a stream are decrypted in turn
+ * as they are read. */
+static int
+decrypt_framed(struct handy *cipher, struct input *in, FILE *to,
+               size_t start, size_t end)
+{
+    char *data;
+    size_t i, len, avail, pos = 0;
+    int last, first = 1, err;
+
+    if (!in->last && (err = readchunk(cipher, in)))
+        return err;
+    data = in->data;
+    for (i = 0; i < in->end && data[i] != '\n'; i++)
+        ;
+    len = 14;
+    if (i == in->end || i < len || memcmp(data, "Zhandy frames ", len)
+        || parse_number(data, &len, i) <= 0 || len != i)
+        return set_error(cipher, HANDY_EFORMAT, "invalid framed ciphertext");
+    in->start = i + 1;
+
+    /* Frames of a regular file are found from the index, and decrypted on
+     * several threads */
+    if (in->map && (start || end != (size_t) -1 || (Threads > 1 && !Trace)))
+        return decrypt_index(cipher, in, in->start, to, start, end);
+
+    while (!err && pos < end) {
+        if (!in->last && (err = readchunk(cipher, in)))
+            break;
+        data = in->data + in->start;
+        avail = in->end - in->start;
+        if (first && (!avail || data[0] == 'Z'))
+            break; /* index */
+
+        /* A frame ends with a blank line */
+        for (i = 0; i + 1 < avail && !(data[i] == '\n' && data[i + 1] == '\n');
+             i++)
+            ;
+        last = 1;
+        if (i + 1 < avail)
+            len = i + 2;
+        else if (in->last)
+            len = avail;
+        else {
+            len = avail - 1;
+            last = 0;
+        }
+        if (first)
+            Parity = 0;
+        i = len;
+        err = decrypt_part(cipher, data, &i, last, to, &pos, start, end);
+        in->start += i;
+        first = last && i == len;
+        if (in->last && in->start == in->end)
+            break;
+    }
+    return err;
+}
+
+/* Output to stream TO the decryption of packed input IN, starting after
+ * its header (see PACKED_HEADER). Words are unpacked to a chunk of letters,
+ * which are decrypted without filtering spaces. */
+static int
+decrypt_packed(struct handy *cipher, struct input *in, FILE *to)
+{
+    static const char *letters =
+        "ABCDEFGHIJKLMNOPQRSTUVWXYabcdefghijklmnopqrstuvwxy";
+
+    char buffer[CHUNK_SIZE], out[OUTPUT_SIZE];
+    size_t len = 0, inlen, outlen;
+    uint64_t word;
+    int i, k, end = 0, err = HANDY_OK;
+
+    do {
+        while (!end && sizeof(buffer) - len >= PACKED_LETTERS) {
+            if (in->end - in->start < 8) {
+                if (in->last)
+                    return set_error(cipher, HANDY_EFORMAT,
+                            "truncated packed ciphertext");
+                if ((err = readchunk(cipher, in)))
+                    return err;
+                continue;
+            }
+            word = get_word(in->data + in->start);
+            in->start += 8;
+            k = PACKED_LETTERS;
+            if (word >= PACKED_FULL) { /* last word */
+                word -= PACKED_FULL;
+                k = (int) (word / PACKED_TENTH);
+                word %= PACKED_TENTH;
+                end = 1;
+            }
+            if (k > PACKED_LETTERS)
+                return set_error(cipher, HANDY_EFORMAT,
+                        "invalid packed ciphertext");
+            for (i = k; i > 0; i--, word /= 50)
+                buffer[len + i - 1] = letters[word % 50];
+            if (word || (end && (in->start < in->end
+                                 || (!in->last && getc(in->file) != EOF))))
+                return set_error(cipher, HANDY_EFORMAT,
+                        "invalid packed ciphertext");
+            len += k;
+        }
+
+        inlen = len;
+        outlen = sizeof(out);
+        err = (end ? handy_decrypt_final : handy_decrypt_update)(cipher,
+                buffer, &inlen, out, &outlen);
+        memmove(buffer, buffer + inlen, len - inlen);
+        len -= inlen;
+        if (to != stdout || !Trace) { /* do not mix trace and output */
+            k = write_stream(cipher, to, out, outlen);
+            err = err ? err : k;
+        }
+    } while (!err && !(end && !len));
+    return err;
+}
+
+int
+handy_encrypt(struct handy *cipher, FILE *from, FILE *to)
+{
+    struct input in[1];
+    int err;
+
+    if (Framed) {
+        open_input(in, from, &Filters[FILTER_PLAINTEXT], 0, 0);
+        err = encrypt_framed(cipher, in, to);
+        close_input(in);
+        return err;
+    }
+    if (Threads > 1 && !Trace)
+        return process_parallel(cipher, from, to,
+                                &Filters[FILTER_PLAINTEXT], encrypt_batch);
+    return process(cipher, from, to, &Filters[FILTER_PLAINTEXT],
+                   handy_encrypt_update, handy_encrypt_final);
+}
+
+/* Decrypt range [START;END[ of stream FROM to stream TO, the
+ * whole ciphertext if RANGE is false. */
+static int
+decrypt_stream(struct handy *cipher, FILE *from, FILE *to, int range,
+               size_t start, size_t end)
+{
+    struct input in[1];
+    struct handy_kdf kdf[1];
+    int c, packed, err;
+
+    /* A key derivation header is skipped */
+    if (handy_read_kdf(from, kdf) < 0)
+        return set_error(cipher, HANDY_EFORMAT,
+                "invalid key derivation header");
+    Expand = Compress ? 0 : -1;
+    Unescape = Escape ? 0 : -1;
+
+    /* Framed and packed ciphertext start with a 'Z' */
+    c = getc(from);
+    ungetc(c, from);
+    if (c == 'Z' && Mac)
+        err = set_error(cipher, HANDY_EMAC, "missing MAC trailer");
+    else if (c == 'Z') {
+        open_input(in, from, 0, 0, 0);
+        err = in->last ? HANDY_OK : readchunk(cipher, in);
+        packed = in->end >= PACKED_HEADER_LEN
+                 && !memcmp(in->data, PACKED_HEADER, PACKED_HEADER_LEN);
+        if (!err && !packed)
+            err = decrypt_framed(cipher, in, to, start, end);
+        else if (!err && range)
+            err = set_error(cipher, HANDY_EFORMAT,
+                    "a range can only be decrypted from framed ciphertext");
+        else if (!err) {
+            in->start = PACKED_HEADER_LEN;
+            err = decrypt_packed(cipher, in, to);
+        }
+        close_input(in);
+    }
+    else if (range)
+        err = set_error(cipher, HANDY_EFORMAT,
+                "a range can only be decrypted from framed ciphertext");
+    else if (Threads > 1 && !Trace)
+        err = process_parallel(cipher, from, to,
+                               &Filters[FILTER_CIPHERTEXT], decrypt_batch);
+    else
+        err = process(cipher, from, to, &Filters[FILTER_CIPHERTEXT],
+                      handy_decrypt_update, handy_decrypt_final);
+    if (!err && Expand > 0)
+        err = set_error(cipher, HANDY_EFORMAT,
+                "truncated compressed plaintext");
+    if (!err && Unescape > 0)
+        err = set_error(cipher, HANDY_EFORMAT,
+                "truncated escaped plaintext");
+    Expand = -1;
+    Unescape = -1;
+    if (!err && to == stdout && !Trace && !Escape)
+        putchar('\n'); /* ensure final '\n' on stdout */
+    return err;
+}
+
+int
+handy_decrypt(struct handy *cipher, FILE *from, FILE *to)
+{
+    return decrypt_stream(cipher, from, to, 0, 0, (size_t) -1);
+}
+
+int
+handy_decrypt_range(struct handy *cipher, FILE *from, FILE *to,
+                    size_t start, size_t end)
+{
+    return decrypt_stream(cipher, from, to, 1, start, end);
+}
+
+/* Shuffle the key characters into KEY with a random source seeded by the
+ * first 16 bytes of HASH. */
+static void
+shuffle_key(const uint8_t *hash, char *key)
+{
+    static const char *keyset =
+        "ABCDEFGHIJKLMNOPQRSTUVWXYabcdefghijklmnopqrstuvwxy^";
+
+    struct pcgstate random[1];
+
+    pcg_seed(random, *((uint64_t *) hash),
+                     *((uint64_t *) (hash + 8)) & 0x7FFFFFFFFFFFFFFF);
+
+    memcpy(key, keyset, 51);
+    shuffle(key, 51, random);
+}
+
+void
+handy_keygen(const char *password, char *key)
+{
+    uint8_t hash[32];
+    SHA256_CTX sha[1];
+
+    pthread_once(&sha256_once, sha256_cpu);
+    sha256_init(sha);
+    sha256_update(sha, (const uint8_t *) password, strlen(password));
+    sha256_final(sha, hash);
+    shuffle_key(hash, key);
+}
+
+/* Initialize KDF with ITERATIONS and a salt drawn from RANDOM. */
+static void
+init_kdf(struct handy_kdf *kdf, unsigned long iterations,
+         struct pcgstate *random)
+{
+    uint32_t r = 0;
+    int i;
+
+    kdf->iterations = iterations;
+    for (i = 0; i < HANDY_SALT_SIZE; i++) {
+        if (!(i & 3))
+            r = pcg_rand(random);
+        kdf->salt[i] = (unsigned char) (r >> 8 * (i & 3));
+    }
+}
+
+int
+handy_kdf_init(struct handy_kdf *kdf, unsigned long iterations)
+{
+    struct pcgstate random[1];
+
+    if (!pcg_entropy(random))
+        return HANDY_ERANDOM;
+    init_kdf(kdf, iterations, random);
+    return HANDY_OK;
+}
+
+void
+handy_kdf_init_seeded(struct handy_kdf *kdf, unsigned long iterations,
+                      uint64_t state, uint64_t sequence)
+{
+    struct pcgstate random[1];
+
+    /* Another stream than the one of the cipher with the same seed */
+    pcg_seed(random, state, ~sequence);
+    init_kdf(kdf, iterations, random);
+}
+
+void
+handy_keygen_kdf(const char *password, const struct handy_kdf *kdf,
+                 char *key)
+{
+    uint8_t hash[32];
+
+    pthread_once(&sha256_once, sha256_cpu);
+    sha256_pbkdf2((const uint8_t *) password, strlen(password),
+                  kdf->salt, HANDY_SALT_SIZE, kdf->iterations,
+                  hash, sizeof(hash));
+    shuffle_key(hash, key);
+}
+
+void
+handy_keygen_kdf_multi(const char *password, const struct handy_kdf *kdf,
+                       size_t n, char (*keys)[51])
+{
+    const uint8_t *pass[SHA256_LANES], *salt[SHA256_LANES];
+    size_t passlen[SHA256_LANES], saltlen[SHA256_LANES], i;
+    uint8_t hash[SHA256_LANES][32], *out[SHA256_LANES];
+    int m, j;
+
+    pthread_once(&sha256_once, sha256_cpu);
+
+    /* Derivations with the same cost are run together */
+    for (i = 0; i < n; i += m) {
+        for (m = 0; m < SHA256_LANES && i + m < n
+                    && kdf[i + m].iterations == kdf[i].iterations; m++) {
+            pass[m] = (const uint8_t *) password;
+            passlen[m] = strlen(password);
+            salt[m] = kdf[i + m].salt;
+            saltlen[m] = HANDY_SALT_SIZE;
+            out[m] = hash[m];
+        }
+        sha256_pbkdf2_multi(m, pass, passlen, salt, saltlen,
+                            kdf[i].iterations, out);
+        for (j = 0; j < m; j++)
+            shuffle_key(hash[j], keys[i + j]);
+    }
+}
+
+int
+handy_write_kdf(FILE *to, const struct handy_kdf *kdf)
+{
+    int i;
+
+    fprintf(to, "#handy kdf pbkdf2-sha256 %lu ", kdf->iterations);
+    for (i = 0; i < HANDY_SALT_SIZE; i++)
+        fprintf(to, "%02x", kdf->salt[i]);
+    fputc('\n', to);
+    return ferror(to) ? HANDY_EIO : HANDY_OK;
+}
+
+int
+handy_read_kdf(FILE *from, struct handy_kdf *kdf)
+{
+    static const char *tag = "#handy kdf pbkdf2-sha256 ";
+    char line[128], *p;
+    unsigned x;
+    int c, i;
+
+    /* The header line starts with a '#' (not a ciphertext character) */
+    c = getc(from);
+    ungetc(c, from);
+    if (c != '#')
+        return 0;
+    if (!fgets(line, sizeof(line), from) || !strchr(line, '\n')
+        || strncmp(line, tag, strlen(tag)))
+        return HANDY_EFORMAT; /* a line with no newline is too long */
+    p = line + strlen(tag);
+    if (*p < '1' || *p > '9')
+        return HANDY_EFORMAT;
+    kdf->iterations = strtoul(p, &p, 10);
+    if (*p++ != ' ')
+        return HANDY_EFORMAT;
+    for (i = 0; i < HANDY_SALT_SIZE; i++, p += 2) {
+        if (!isxdigit(CHR(p[0])) || !isxdigit(CHR(p[1]))
+            || sscanf(p, "%2x", &x) != 1)
+            return HANDY_EFORMAT;
+        kdf->salt[i] = (unsigned char) x;
+    }
+    if (strcmp(p, "\n"))
+        return HANDY_EFORMAT;
+    return 1;
 }
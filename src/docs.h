@@ -1,7 +1,10 @@
 static const char *docs_usage =
 "usage: handy [-e|--encrypt] [-d|--decrypt] [-k|--key <file>] [--core]\n"
 "             [-o|--output <file>] [-V|--version] [--help] [--trace]\n"
-"             [<infile>]";
+"             [--threads <n>] [--framed] [--range <start>:<end>]\n"
+"             [--seed <state>[:<sequence>]] [--batch] [--iterations <n>]\n"
+"             [--save-key <file>] [--mac] [--packed] [--compress]\n"
+"             [--escape] [--density <percent>] [<infile>...]";
 
 static const char *docs_summary =
 "handy encrypts files with the low-tech randomized symmetric-key Handycipher.";
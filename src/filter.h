@@ -0,0 +1,281 @@
+#ifndef FILTER_H
+#define FILTER_H
+
+/* Filter spaces out of input buffers and check their alphabet.
+ * Spaces are the C locale isspace() characters. Buffers are processed with
+ * AVX2 or SSE2 instructions when available (chosen at run time), and with
+ * plain C code otherwise.
+ *
+ * To get the implementation, define FILTER_IMPLEMENTATION.
+ * Optionally define FILTER_API to control the API's visibility
+ * and/or linkage (static, __attribute__, __declspec).
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifndef FILTER_API
+#define FILTER_API
+#endif
+
+/* Accepted alphabets. */
+#define FILTER_CIPHERTEXT 0 /* A-Y a-y */
+#define FILTER_PLAINTEXT  1 /* A-Z . , ? - ^ */
+
+struct filter {
+    int alphabet;
+    int simd;               /* 0: none, 1: SSE2, 2: AVX2 */
+    uint64_t shuffle[256];  /* indexes of the non-space bytes of 8 bytes */
+};
+
+/* Initialize filter F for ALPHABET. */
+FILTER_API
+void filter_init(struct filter *f, int alphabet);
+
+/* Remove the spaces of BUF of LEN bytes, moving the other characters to the
+ * front of BUF. Set *BAD to the index in the result of the first character
+ * that is not in the alphabet, or to the result length if there is none.
+ * Return the length of the result. */
+FILTER_API
+size_t filter_spaces(struct filter *f, char *buf, size_t len, size_t *bad);
+
+/* Return the index of the first character of BUF of LEN bytes that is neither
+ * a space nor in the alphabet, or LEN if there is none. */
+FILTER_API
+size_t filter_check(struct filter *f, const char *buf, size_t len);
+
+/* Implementation. */
+#ifdef FILTER_IMPLEMENTATION
+
+#if defined(__GNUC__) && defined(__x86_64__)
+#define FILTER_X86
+#include <immintrin.h>
+#endif
+
+/* Return true if byte C is a space. */
+static int
+filter_isspace(unsigned char c)
+{
+    return c == ' ' || (c >= '\t' && c <= '\r');
+}
+
+/* Return true if byte C is in ALPHABET. */
+static int
+filter_isvalid(int alphabet, unsigned char c)
+{
+    if (alphabet == FILTER_CIPHERTEXT)
+        return (c >= 'A' && c <= 'Y') || (c >= 'a' && c <= 'y');
+    return (c >= 'A' && c <= 'Z')
+        || c == '.' || c == ',' || c == '?' || c == '-' || c == '^';
+}
+
+/* Scalar version of filter_spaces() on [FROM;LEN[, writing at TO. */
+static size_t
+filter_spaces_c(struct filter *f, char *buf, size_t from, size_t to,
+                size_t len, size_t *bad)
+{
+    unsigned char c;
+
+    for (; from < len; from++) {
+        c = buf[from];
+        if (filter_isspace(c))
+            continue;
+        if (*bad == (size_t) -1 && !filter_isvalid(f->alphabet, c))
+            *bad = to;
+        buf[to++] = c;
+    }
+    return to;
+}
+
+#ifdef FILTER_X86
+
+/* Return a mask of the bytes of X in [LO;LO+N[ (SSE2). */
+static __m128i
+filter_range128(__m128i x, int lo, int n)
+{
+    x = _mm_sub_epi8(x, _mm_set1_epi8((char) (lo - 128)));
+    return _mm_cmplt_epi8(x, _mm_set1_epi8((char) (n - 128)));
+}
+
+/* Return the bit masks of the spaces and of the invalid bytes in X. */
+static void
+filter_classify128(int alphabet, __m128i x, unsigned *space, unsigned *bad)
+{
+    __m128i s, v;
+
+    s = _mm_or_si128(_mm_cmpeq_epi8(x, _mm_set1_epi8(' ')),
+                     filter_range128(x, '\t', 5));
+    if (alphabet == FILTER_CIPHERTEXT)
+        v = _mm_or_si128(filter_range128(x, 'A', 25),
+                         filter_range128(x, 'a', 25));
+    else
+        v = _mm_or_si128(
+                _mm_or_si128(filter_range128(x, 'A', 26),
+                             filter_range128(x, ',', 3)),  /* , - . */
+                _mm_or_si128(_mm_cmpeq_epi8(x, _mm_set1_epi8('?')),
+                             _mm_cmpeq_epi8(x, _mm_set1_epi8('^'))));
+    *space = _mm_movemask_epi8(s);
+    *bad = ~(*space | _mm_movemask_epi8(v)) & 0xffff;
+}
+
+/* SSE2 version of filter_spaces(). */
+static size_t
+filter_spaces_sse2(struct filter *f, char *buf, size_t len, size_t *bad)
+{
+    size_t i, n = 0;
+    unsigned space, invalid, keep;
+    __m128i x;
+
+    for (i = 0; i + 16 <= len; i += 16) {
+        x = _mm_loadu_si128((const __m128i *) (buf + i));
+        filter_classify128(f->alphabet, x, &space, &invalid);
+        if (invalid && *bad == (size_t) -1)
+            *bad = n + __builtin_popcount(~space & ((invalid & -invalid) - 1));
+        if (!space) {
+            _mm_storeu_si128((__m128i *) (buf + n), x);
+            n += 16;
+            continue;
+        }
+        for (keep = ~space & 0xffff; keep; keep &= keep - 1)
+            buf[n++] = buf[i + __builtin_ctz(keep)];
+    }
+    return filter_spaces_c(f, buf, i, n, len, bad);
+}
+
+/* Return a mask of the bytes of X in [LO;LO+N[ (AVX2). */
+__attribute__((target("avx2")))
+static __m256i
+filter_range256(__m256i x, int lo, int n)
+{
+    x = _mm256_sub_epi8(x, _mm256_set1_epi8((char) (lo - 128)));
+    return _mm256_cmpgt_epi8(_mm256_set1_epi8((char) (n - 128)), x);
+}
+
+/* AVX2 version of filter_spaces(). Groups of 8 bytes are compacted with a
+ * byte shuffle, see 'Parsing Gigabytes of JSON per Second' by Geoff Langdale
+ * and Daniel Lemire. */
+__attribute__((target("avx2")))
+static size_t
+filter_spaces_avx2(struct filter *f, char *buf, size_t len, size_t *bad)
+{
+    size_t i, n = 0;
+    uint32_t space, invalid;
+    __m256i x, s, v, y;
+    __m128i lo, hi;
+    const long long high = 0x0808080808080808LL;
+
+    for (i = 0; i + 32 <= len; i += 32) {
+        x = _mm256_loadu_si256((const __m256i *) (buf + i));
+        s = _mm256_or_si256(_mm256_cmpeq_epi8(x, _mm256_set1_epi8(' ')),
+                            filter_range256(x, '\t', 5));
+        if (f->alphabet == FILTER_CIPHERTEXT)
+            v = _mm256_or_si256(filter_range256(x, 'A', 25),
+                                filter_range256(x, 'a', 25));
+        else
+            v = _mm256_or_si256(
+                    _mm256_or_si256(filter_range256(x, 'A', 26),
+                                    filter_range256(x, ',', 3)),
+                    _mm256_or_si256(
+                        _mm256_cmpeq_epi8(x, _mm256_set1_epi8('?')),
+                        _mm256_cmpeq_epi8(x, _mm256_set1_epi8('^'))));
+        space = (uint32_t) _mm256_movemask_epi8(s);
+        invalid = ~(space | (uint32_t) _mm256_movemask_epi8(v));
+        if (invalid && *bad == (size_t) -1)
+            *bad = n + __builtin_popcount(~space & ((invalid & -invalid) - 1));
+        if (!space) {
+            _mm256_storeu_si256((__m256i *) (buf + n), x);
+            n += 32;
+            continue;
+        }
+        y = _mm256_shuffle_epi8(x, _mm256_set_epi64x(
+                (long long) f->shuffle[space >> 24] + high,
+                (long long) f->shuffle[(space >> 16) & 0xff],
+                (long long) f->shuffle[(space >> 8) & 0xff] + high,
+                (long long) f->shuffle[space & 0xff]));
+        lo = _mm256_castsi256_si128(y);
+        hi = _mm256_extracti128_si256(y, 1);
+        _mm_storel_epi64((__m128i *) (buf + n), lo);
+        n += 8 - __builtin_popcount(space & 0xff);
+        _mm_storel_epi64((__m128i *) (buf + n), _mm_srli_si128(lo, 8));
+        n += 8 - __builtin_popcount((space >> 8) & 0xff);
+        _mm_storel_epi64((__m128i *) (buf + n), hi);
+        n += 8 - __builtin_popcount((space >> 16) & 0xff);
+        _mm_storel_epi64((__m128i *) (buf + n), _mm_srli_si128(hi, 8));
+        n += 8 - __builtin_popcount(space >> 24);
+    }
+    return filter_spaces_c(f, buf, i, n, len, bad);
+}
+
+#endif /* FILTER_X86 */
+
+FILTER_API
+void
+filter_init(struct filter *f, int alphabet)
+{
+    int m, i, n;
+    uint64_t s;
+
+    f->alphabet = alphabet;
+    f->simd = 0;
+#ifdef FILTER_X86
+    f->simd = __builtin_cpu_supports("avx2") ? 2 : 1;
+#endif
+    for (m = 0; m < 256; m++) {
+        for (s = 0, i = 0, n = 0; i < 8; i++)
+            if (!(m & (1 << i)))
+                s |= (uint64_t) i << (8 * n++);
+        for (; n < 8; n++)
+            s |= (uint64_t) 0x80 << (8 * n); /* shuffle in a zero */
+        f->shuffle[m] = s;
+    }
+}
+
+FILTER_API
+size_t
+filter_spaces(struct filter *f, char *buf, size_t len, size_t *bad)
+{
+    size_t n;
+
+    *bad = (size_t) -1;
+    switch (f->simd) {
+#ifdef FILTER_X86
+    case 2:
+        n = filter_spaces_avx2(f, buf, len, bad);
+        break;
+    case 1:
+        n = filter_spaces_sse2(f, buf, len, bad);
+        break;
+#endif
+    default:
+        n = filter_spaces_c(f, buf, 0, 0, len, bad);
+    }
+    if (*bad == (size_t) -1)
+        *bad = n;
+    return n;
+}
+
+FILTER_API
+size_t
+filter_check(struct filter *f, const char *buf, size_t len)
+{
+    size_t i = 0;
+#ifdef FILTER_X86
+    unsigned space, invalid;
+
+    if (f->simd)
+        for (; i + 16 <= len; i += 16) {
+            filter_classify128(f->alphabet,
+                    _mm_loadu_si128((const __m128i *) (buf + i)),
+                    &space, &invalid);
+            if (invalid)
+                return i + __builtin_ctz(invalid);
+        }
+#endif
+    for (; i < len; i++)
+        if (!filter_isspace(buf[i]) && !filter_isvalid(f->alphabet, buf[i]))
+            return i;
+    return len;
+}
+
+#endif /* FILTER_IMPLEMENTATION */
+#endif /* FILTER_H */
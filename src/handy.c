@@ -5,14 +5,12 @@
 #include <fcntl.h>
 #include <unistd.h>
 #include <termios.h>
+#include <pthread.h>
 #include <sys/errno.h>
 
 #include "../config.h"
 #include "docs.h"
-
-extern void handy_encrypt(FILE *f, FILE *t, char *key, int core, int trace);
-extern void handy_decrypt(FILE *f, FILE *t, char *key, int core, int trace);
-extern void handy_keygen(char *password, char *key);
+#include "handy.h"
 
 #define OPTPARSE_IMPLEMENTATION
 #define OPTPARSE_API static
@@ -102,29 +100,411 @@ get_password(char *buf, size_t len, char *prompt)
             fatal("could not read password from /dev/tty");
     }
 }
-/* Load the KEY stored in file KEYFILE. If KEYFILE is null, read a password
- * from terminal and generate a key. */
-static void
-load_key(char *keyfile, char *key)
+/* Load the KEY stored in file KEYFILE. Return true if it is followed by the
+ * key derivation parameters it was derived with, read into KDF. */
+static int
+load_key(char *keyfile, char *key, struct handy_kdf *kdf)
 {
     FILE *in;
     size_t sz;
-    char password[HANDY_PASSWORD_MAX];
+    int c, err;
+
+    if (!(in = fopen(keyfile, "r")))
+        fatal("could not open key file '%s' -- %s",
+                keyfile, strerror(errno));
+    if ((sz = fread(key, 1, 51, in)) != 51)
+        fatal("could not read key in keyfile -- %s", keyfile);
+    if ((c = getc(in)) != '\n')
+        ungetc(c, in);
+    if ((err = handy_read_kdf(in, kdf)) < 0)
+        fatal("invalid key derivation parameters in keyfile -- %s", keyfile);
+    fclose(in);
+    return err;
+}
+
+/* Save KEY to file KEYFILE, readable by its owner only, followed by the key
+ * derivation parameters KDF if not null. */
+static void
+save_key(char *keyfile, const char *key, const struct handy_kdf *kdf)
+{
+    FILE *out;
+    int fd;
+
+    if ((fd = open(keyfile, O_WRONLY | O_CREAT | O_TRUNC, 0600)) == -1
+        || close(fd) || !(out = fopen(keyfile, "w")))
+        fatal("could not open key file '%s' -- %s",
+                keyfile, strerror(errno));
+    fwrite(key, 1, 51, out);
+    fputc('\n', out);
+    if (kdf)
+        handy_write_kdf(out, kdf);
+    if (ferror(out) | fclose(out))
+        fatal("could not write key file '%s' -- %s",
+                keyfile, strerror(errno));
+}
+
+/* Read a password from terminal into PASSWORD. */
+static void
+read_password(char *password)
+{
+    get_password(password, HANDY_PASSWORD_MAX, "password: ");
+    if (!*password)
+        fatal("password has length zero");
+}
+
+/* Parse a decimal number at *S into *N and advance *S.
+ * Return false if there is no number or it is too large. */
+static int
+parse_u64(char **s, uint64_t *n)
+{
+    char *p;
+
+    for (*n = 0, p = *s; *p >= '0' && *p <= '9'; p++) {
+        if (*n > (UINT64_MAX - (*p - '0')) / 10)
+            return 0;
+        *n = 10 * *n + (*p - '0');
+    }
+    if (p == *s)
+        return 0;
+    *s = p;
+    return 1;
+}
+
+/* Files of a batch, processed by a pool of threads. */
+struct batch {
+    char **files;
+    size_t nfiles;
+    int nworkers;           /* worker K processes files K, K + NWORKERS... */
+    pthread_mutex_t lock;
+    int crypt;
+    int flags;
+    int density;
+    const uint64_t *seed;   /* state and sequence of the random source, or 0
+                               for system entropy */
+    int range;
+    unsigned long start;
+    unsigned long end;
+    const struct handy_kdf *kdf;    /* header of encrypted files, if any */
+    const char *password;   /* to decrypt with the key of each header */
+    struct session *keys;   /* keys derived from the password */
+    int failed;             /* number of files that could not be processed */
+};
+
+/* Key derived from the password of a batch, with parameters KDF if HASKDF
+ * is true and with a single hash otherwise, and a cipher context keyed with
+ * it, which workers clone. */
+struct session {
+    int haskdf;
+    struct handy_kdf kdf;
+    struct handy *cipher;
+    struct session *next;
+};
+
+/* A thread of the pool, with its own cipher context, keyed with the key of
+ * SESSION if not null. */
+struct worker {
+    struct batch *batch;
+    int index;
+    struct handy *cipher;
+    struct session *session;
+    pthread_t thread;
+};
+
+/* Suffix of ciphertext files in a batch. */
+#define BATCH_SUFFIX ".hdy"
+
+/* Add file NAME to BATCH. */
+static void
+batch_add(struct batch *batch, const char *name)
+{
+    char *copy;
+
+    if (!(batch->nfiles & (batch->nfiles + 1)))  /* 0, 1, 3, 7... */
+        if (!(batch->files = realloc(batch->files,
+                        2 * (batch->nfiles + 1) * sizeof(char *))))
+            fatal("out of memory");
+    if (!(copy = malloc(strlen(name) + 1)))
+        fatal("out of memory");
+    batch->files[batch->nfiles++] = strcpy(copy, name);
+}
+
+/* Add the file names read from standard input, one per line, to BATCH. */
+static void
+batch_read(struct batch *batch)
+{
+    char line[FILENAME_MAX + 2];
+    size_t len;
 
-    if (keyfile) {
-        if (!(in = fopen(keyfile, "r")))
-            fatal("could not open key file '%s' -- %s",
-                    keyfile, strerror(errno));
-        if ((sz = fread(key, 1, 51, in)) != 51)
-            fatal("could not read key in keyfile -- %s", keyfile);
+    while (fgets(line, sizeof(line), stdin)) {
+        len = strlen(line);
+        if (len && line[len - 1] == '\n')
+            line[--len] = 0;
+        else if (!feof(stdin))
+            fatal("file name too long -- %.32s...", line);
+        if (len)
+            batch_add(batch, line);
+    }
+    if (ferror(stdin))
+        fatal("could not read file names -- %s", strerror(errno));
+}
+
+/* Report the failure of BATCH on file NAME. */
+static void
+batch_error(struct batch *batch, const char *name, const char *msg)
+{
+    pthread_mutex_lock(&batch->lock);
+    fprintf(stderr, "handy: %s -- %s\n", name, msg);
+    batch->failed++;
+    pthread_mutex_unlock(&batch->lock);
+}
+
+/* Return true if key derivation parameters A and B are the same. */
+static int
+kdf_equal(const struct handy_kdf *a, const struct handy_kdf *b)
+{
+    return a->iterations == b->iterations
+        && !memcmp(a->salt, b->salt, HANDY_SALT_SIZE);
+}
+
+/* Return the key of BATCH derived with parameters KDF (with a single hash if
+ * KDF is null), or 0 if it is not derived yet. */
+static struct session *
+batch_find(struct batch *batch, const struct handy_kdf *kdf)
+{
+    struct session *s;
+
+    for (s = batch->keys; s; s = s->next)
+        if (kdf ? s->haskdf && kdf_equal(&s->kdf, kdf) : !s->haskdf)
+            break;
+    return s;
+}
+
+/* Add KEY derived with parameters KDF to the keys of BATCH, with a cipher
+ * context keyed and seeded as the one of the batch. Return it, or 0 if out
+ * of memory. */
+static struct session *
+batch_save(struct batch *batch, const struct handy_kdf *kdf, const char *key)
+{
+    struct session *s;
+    int err;
+
+    if (!(s = malloc(sizeof(struct session))))
+        return 0;
+    if (!(s->cipher = handy_new())) {
+        free(s);
+        return 0;
+    }
+    if (batch->seed)
+        err = handy_init_seeded(s->cipher, key, batch->flags,
+                                batch->seed[0], batch->seed[1]);
+    else
+        err = handy_init(s->cipher, key, batch->flags);
+    if (err)
+        fatal("%s", handy_errmsg(s->cipher));
+    handy_set_density(s->cipher, batch->density);
+    if ((s->haskdf = kdf != 0))
+        s->kdf = *kdf;
+    s->next = batch->keys;
+    batch->keys = s;
+    return s;
+}
+
+/* Give worker W a clone of the context keyed with the key derived from the
+ * password of its batch with parameters KDF, or with a single hash if KDF is
+ * null. A key is derived only once per batch (other threads wait
+ * meanwhile). Return false if out of memory. */
+static int
+batch_key(struct worker *w, const struct handy_kdf *kdf)
+{
+    struct batch *batch = w->batch;
+    struct session *s;
+    char key[51];
+
+    pthread_mutex_lock(&batch->lock);
+    if (!(s = batch_find(batch, kdf))) {
+        if (kdf)
+            handy_keygen_kdf(batch->password, kdf, key);
+        else
+            handy_keygen(batch->password, key);
+        s = batch_save(batch, kdf, key);
+    }
+    if (s && s != w->session) {
+        handy_free(w->cipher);
+        w->cipher = handy_clone(s->cipher);
+        w->session = w->cipher ? s : 0;
+    }
+    pthread_mutex_unlock(&batch->lock);
+    return s && w->cipher;
+}
+
+/* Derive together the keys of the headers of the files of BATCH, which are
+ * decrypted with a password. Unreadable files are left to batch_file(). */
+static void
+batch_derive(struct batch *batch)
+{
+    struct handy_kdf *kdfs = 0, kdf[1];
+    char (*keys)[51] = 0;
+    size_t i, j, n = 0;
+    FILE *in;
+
+    for (i = 0; i < batch->nfiles; i++) {
+        if (!(in = fopen(batch->files[i], "r")))
+            continue;
+        if (handy_read_kdf(in, kdf) == 1) {
+            for (j = 0; j < n && !kdf_equal(kdfs + j, kdf); j++)
+                ;
+            if (j == n && !(n & (n + 1)))  /* 0, 1, 3, 7... */
+                if (!(kdfs = realloc(kdfs, 2 * (n + 1) * sizeof(*kdfs))))
+                    fatal("out of memory");
+            if (j == n)
+                kdfs[n++] = *kdf;
+        }
         fclose(in);
     }
-    else {
-        get_password(password, HANDY_PASSWORD_MAX, "password: ");
-        if (!*password)
-            fatal("password has length zero");
-        handy_keygen(password, key);
+    if (n && !(keys = malloc(n * sizeof(*keys))))
+        fatal("out of memory");
+    handy_keygen_kdf_multi(batch->password, kdfs, n, keys);
+    for (i = 0; i < n; i++)
+        if (!batch_save(batch, kdfs + i, keys[i]))
+            fatal("out of memory");
+    free(keys);
+    free(kdfs);
+}
+
+/* Encrypt file NAME with worker W to NAME.hdy, or decrypt NAME.hdy to NAME
+ * (to NAME.out if NAME has no .hdy suffix). */
+static void
+batch_file(struct worker *w, const char *name)
+{
+    struct batch *batch = w->batch;
+    struct handy *cipher;
+    struct handy_kdf kdf[1];
+    size_t len = strlen(name), n = strlen(BATCH_SUFFIX);
+    const char *msg = 0;
+    char *outfile;
+    FILE *in, *out;
+    int err = HANDY_OK;
+
+    if (!(outfile = malloc(len + n + 1))) {
+        batch_error(batch, name, "out of memory");
+        return;
+    }
+    strcpy(outfile, name);
+    if (batch->crypt)
+        strcpy(outfile + len, BATCH_SUFFIX);
+    else if (len > n && !strcmp(name + len - n, BATCH_SUFFIX))
+        outfile[len - n] = 0;
+    else
+        strcpy(outfile + len, ".out");
+
+    if (!(in = fopen(name, "r"))) {
+        batch_error(batch, name, strerror(errno));
+        free(outfile);
+        return;
+    }
+    if (!(out = fopen(outfile, "w"))) {
+        batch_error(batch, outfile, strerror(errno));
+        fclose(in);
+        free(outfile);
+        return;
+    }
+
+    /* Files decrypted with a password may each have their own salt */
+    if (!batch->crypt && batch->password) {
+        if ((err = handy_read_kdf(in, kdf)) < 0)
+            msg = "invalid key derivation header";
+        else if (!batch_key(w, err ? kdf : 0))
+            msg = "out of memory";
+    }
+
+    cipher = w->cipher;
+    if (!msg) {
+        handy_reset(cipher);
+        if (batch->crypt && batch->kdf && handy_write_kdf(out, batch->kdf))
+            msg = "could not write key derivation header";
+        else if (batch->crypt)
+            err = handy_encrypt(cipher, in, out);
+        else if (batch->range)
+            err = handy_decrypt_range(cipher, in, out, batch->start,
+                                      batch->end);
+        else
+            err = handy_decrypt(cipher, in, out);
+    }
+    if (err < 0 && !msg)
+        msg = handy_errmsg(cipher);
+    fclose(in);
+    if (fclose(out) && !msg) {
+        name = outfile;
+        msg = strerror(errno);
+    }
+    if (msg) {
+        batch_error(batch, name, msg);
+        remove(outfile);
+    }
+    free(outfile);
+}
+
+/* Process the files of a worker. Each worker has its files, in order, so
+ * that seeded encryptions are reproducible for a given number of
+ * threads. */
+static void *
+batch_worker(void *arg)
+{
+    struct worker *w = arg;
+    struct batch *batch = w->batch;
+    size_t i;
+
+    for (i = w->index; i < batch->nfiles; i += batch->nworkers)
+        batch_file(w, batch->files[i]);
+    return 0;
+}
+
+/* Process the files of BATCH on THREADS threads, with clones of CIPHER, or
+ * of the contexts keyed with the key of each file if CIPHER is null.
+ * Return the number of files that failed. */
+static int
+batch_run(struct batch *batch, struct handy *cipher, int threads)
+{
+    struct worker *workers;
+    struct session *s;
+    int i, started;
+
+    if (threads > batch->nfiles)
+        threads = batch->nfiles ? (int) batch->nfiles : 1;
+    if (!(workers = calloc(threads, sizeof(struct worker))))
+        fatal("out of memory");
+    batch->nworkers = threads;
+    if (!batch->crypt && batch->password)
+        batch_derive(batch);
+    if (cipher)
+        handy_set_threads(cipher, 1);  /* files are processed concurrently */
+    for (i = 0; i < threads; i++) {
+        workers[i].batch = batch;
+        workers[i].index = i;
+        if (cipher && !(workers[i].cipher = handy_clone(cipher)))
+            fatal("out of memory");
+    }
+
+    /* The calling thread is worker 0 and does the work of the workers whose
+     * thread cannot start. */
+    for (i = 1, started = 1; i < threads; i++, started++)
+        if (pthread_create(&workers[i].thread, 0, batch_worker, workers + i))
+            break;
+    batch_worker(workers);
+    for (i = 1; i < started; i++)
+        pthread_join(workers[i].thread, 0);
+    for (i = started; i < threads; i++)
+        batch_worker(workers + i);
+
+    for (i = 0; i < threads; i++)
+        handy_free(workers[i].cipher);
+    free(workers);
+    while ((s = batch->keys)) {
+        batch->keys = s->next;
+        handy_free(s->cipher);
+        free(s);
     }
+    return batch->failed;
 }
 
 int
@@ -139,14 +519,35 @@ main(int argc, char **argv)
         {"help",    256, OPTPARSE_NONE},
         {"trace",   257, OPTPARSE_NONE},
         {"core",    258, OPTPARSE_NONE},
+        {"threads", 259, OPTPARSE_REQUIRED},
+        {"framed",  260, OPTPARSE_NONE},
+        {"range",   261, OPTPARSE_REQUIRED},
+        {"seed",    262, OPTPARSE_REQUIRED},
+        {"batch",   263, OPTPARSE_NONE},
+        {"iterations", 264, OPTPARSE_REQUIRED},
+        {"save-key", 265, OPTPARSE_REQUIRED},
+        {"mac",     266, OPTPARSE_NONE},
+        {"packed",  267, OPTPARSE_NONE},
+        {"compress", 268, OPTPARSE_NONE},
+        {"density", 269, OPTPARSE_REQUIRED},
+        {"escape",  270, OPTPARSE_NONE},
         {0, 0, 0}
     };
-    int option, crypt = 1, trace = 0, core = 0;
-    char *infile, *outfile = 0, *keyfile = 0;
+    int option, crypt = 1, flags = 0, threads = 1, range = 0, seeded = 0, err;
+    int batched = 0, haskdf = 0;
+    long density = HANDY_DENSITY;
+    uint64_t seed[2] = {0, 0};
+    char *infile, *outfile = 0, *keyfile = 0, *savefile = 0, *p;
+    unsigned long start = 0, end = (unsigned long) -1;
+    unsigned long iterations = HANDY_KDF_ITERATIONS;
     struct optparse options[1];
+    struct batch batch[1];
+    struct handy_kdf kdf[1];
+    char password[HANDY_PASSWORD_MAX];
 
     FILE *in = stdin, *out = stdout;
     char key[51];
+    struct handy *cipher;
 
     optparse_init(options, argv);
     while ((option = optparse(options, global)) != OPTPARSE_DONE) {
@@ -164,10 +565,68 @@ main(int argc, char **argv)
             outfile = options->optarg;
             break;
         case 257:
-            trace = 1;
+            flags |= HANDY_TRACE;
             break;
         case 258:
-            core = 1;
+            flags |= HANDY_CORE;
+            break;
+        case 259:
+            threads = atoi(options->optarg);
+            if (threads < 1 || threads > HANDY_THREADS_MAX)
+                fatal("invalid number of threads -- %s", options->optarg);
+            break;
+        case 260:
+            flags |= HANDY_FRAMED;
+            break;
+        case 261:
+            range = 1;
+            p = options->optarg;
+            if (*p != ':')
+                start = strtoul(p, &p, 10);
+            if (*p++ != ':')
+                fatal("invalid range -- %s", options->optarg);
+            if (*p)
+                end = strtoul(p, &p, 10);
+            if (*p || end < start)
+                fatal("invalid range -- %s", options->optarg);
+            break;
+        case 262:
+            seeded = 1;
+            p = options->optarg;
+            if (!parse_u64(&p, seed)
+                || (*p == ':' && (p++, !parse_u64(&p, seed + 1))) || *p)
+                fatal("invalid seed -- %s", options->optarg);
+            break;
+        case 263:
+            batched = 1;
+            break;
+        case 264:
+            p = options->optarg;
+            iterations = strtoul(p, &p, 10);
+            if (*p || *options->optarg < '0' || *options->optarg > '9')
+                fatal("invalid number of iterations -- %s", options->optarg);
+            break;
+        case 265:
+            savefile = options->optarg;
+            break;
+        case 266:
+            flags |= HANDY_MAC;
+            break;
+        case 267:
+            flags |= HANDY_PACKED;
+            break;
+        case 268:
+            flags |= HANDY_COMPRESS;
+            break;
+        case 269:
+            p = options->optarg;
+            density = strtol(p, &p, 10);
+            if (*p || *options->optarg < '0' || *options->optarg > '9'
+                || density > 100)
+                fatal("invalid density -- %s", options->optarg);
+            break;
+        case 270:
+            flags |= HANDY_ESCAPE;
             break;
         case 'V':
             puts("handy " STR(HANDY_VERSION));
@@ -184,13 +643,102 @@ main(int argc, char **argv)
         }
     }
     infile = optparse_arg(options);
+    if ((flags & HANDY_MAC) && (flags & HANDY_FRAMED))
+        fatal("--mac cannot be used with --framed");
+    if ((flags & HANDY_PACKED) && (flags & (HANDY_FRAMED | HANDY_MAC)))
+        fatal("--packed cannot be used with --framed or --mac");
+    if ((flags & HANDY_COMPRESS) && (flags & HANDY_FRAMED))
+        fatal("--compress cannot be used with --framed");
+    if ((flags & HANDY_ESCAPE) && (flags & HANDY_FRAMED))
+        fatal("--escape cannot be used with --framed");
+    if (range && crypt)
+        fatal("--range cannot be used to encrypt");
+
+    memset(batch, 0, sizeof(batch));
+    if (infile && (p = optparse_arg(options))) {
+        batched = 1;
+        batch_add(batch, infile);
+        do
+            batch_add(batch, p);
+        while ((p = optparse_arg(options)));
+    }
+    else if (batched && infile)
+        batch_add(batch, infile);
+    if (batched) {
+        if (outfile)
+            fatal("--output cannot be used with several files");
+        if (flags & HANDY_TRACE)
+            fatal("--trace cannot be used with several files");
+        if (!batch->nfiles)
+            batch_read(batch);
+    }
 
-    load_key(keyfile, key);
+    if (batched && !crypt && !keyfile && savefile)
+        fatal("--save-key cannot be used to decrypt several files");
+
+    if (keyfile)
+        haskdf = load_key(keyfile, key, kdf);
+    else
+        read_password(password);
 
-    if (infile && !(in = fopen(infile, "r")))
+    if (!batched && infile && !(in = fopen(infile, "r")))
         fatal("could not open input file '%s' -- %s",
                 infile, strerror(errno));
 
+    /* A password is stretched with the parameters of the ciphertext header,
+     * or with new ones to encrypt */
+    if (!keyfile) {
+        if (crypt && iterations) {
+            if (seeded)
+                handy_kdf_init_seeded(kdf, iterations, seed[0], seed[1]);
+            else if (handy_kdf_init(kdf, iterations))
+                fatal("cannot initialize random source");
+            haskdf = 1;
+        }
+        else if (!crypt && !batched
+                 && (haskdf = handy_read_kdf(in, kdf)) < 0)
+            fatal("invalid key derivation header");
+        /* Batched decryption derives the key of each file with its
+         * header, see batch_file() */
+        if (haskdf)
+            handy_keygen_kdf(password, kdf, key);
+        else if (crypt || !batched)
+            handy_keygen(password, key);
+    }
+    if (savefile)
+        save_key(savefile, key, haskdf ? kdf : 0);
+
+    cipher = 0;
+    if (keyfile || crypt || !batched) {
+        if (!(cipher = handy_new()))
+            fatal("out of memory");
+        if (seeded)
+            err = handy_init_seeded(cipher, key, flags, seed[0], seed[1]);
+        else
+            err = handy_init(cipher, key, flags);
+        if (err)
+            fatal("%s", handy_errmsg(cipher));
+        handy_set_threads(cipher, threads);
+        handy_set_density(cipher, (int) density);
+    }
+
+    if (batched) {
+        batch->crypt = crypt;
+        batch->flags = flags;
+        batch->density = (int) density;
+        batch->seed = seeded ? seed : 0;
+        batch->kdf = crypt && haskdf ? kdf : 0;
+        batch->password = keyfile ? 0 : password;
+        batch->range = range;
+        batch->start = start;
+        batch->end = end;
+        pthread_mutex_init(&batch->lock, 0);
+        err = batch_run(batch, cipher, threads);
+        pthread_mutex_destroy(&batch->lock);
+        handy_free(cipher);
+        return err ? EXIT_FAILURE : 0;
+    }
+
     if (outfile) {
         if (!(out = fopen(outfile, "w")))
             fatal("could not open output file '%s' -- %s",
@@ -199,10 +747,17 @@ main(int argc, char **argv)
     }
     cleanup_fd = out;
 
+    if (crypt && haskdf && handy_write_kdf(out, kdf))
+        fatal("could not write key derivation header");
     if (crypt)
-        handy_encrypt(in, out, key, core, trace);
+        err = handy_encrypt(cipher, in, out);
+    else if (range)
+        err = handy_decrypt_range(cipher, in, out, start, end);
     else
-        handy_decrypt(in, out, key, core, trace);
+        err = handy_decrypt(cipher, in, out);
+    if (err)
+        fatal("%s", handy_errmsg(cipher));
+    handy_free(cipher);
 
     if (infile)
         fclose(in);
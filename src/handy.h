@@ -0,0 +1,195 @@
+#ifndef HANDY_H
+#define HANDY_H
+
+/* Encrypt and decrypt with the Handycipher.
+ *
+ * A cipher context is allocated with handy_new() and keyed with handy_init().
+ * A context encrypts or decrypts one message; call handy_reset() to start
+ * another one with the same key. Contexts share no state and may be used from
+ * different threads: handy_clone() copies a keyed context for another thread.
+ *
+ * The update functions read *INLEN bytes of IN and write at most *OUTLEN
+ * bytes to OUT. They set *INLEN to the number of bytes consumed and *OUTLEN
+ * to the number of bytes written. Input may be left unconsumed, because the
+ * cipher needs to look ahead or OUT is full: it must be given again, followed
+ * by new input, to the next call. The final functions do the same for the
+ * end of the message; they must be called until all input is consumed.
+ * Encryption output needs at least HANDY_OUTPUT_MIN bytes of room.
+ *
+ * With HANDY_MAC, encryption ends with a trailer line holding a MAC of the
+ * ciphertext, keyed with the cipher key. Decryption with HANDY_MAC requires
+ * a trailer and checks it when its last character is read; without it, a
+ * trailer is skipped and the ciphertext is not hashed. Plaintext is output
+ * before it is authenticated: on a HANDY_EMAC error, it must be discarded.
+ *
+ * With HANDY_PACKED, encryption writes binary ciphertext: a header line,
+ * then each 11 letters packed in 8 bytes, without spaces. handy_decrypt()
+ * recognizes it, while the decrypt update functions only read letters.
+ * Packed ciphertext has no MAC trailer.
+ *
+ * With HANDY_COMPRESS, handy_encrypt() compresses the plaintext before
+ * encrypting it: each run of spaces is kept as a '^', leading and trailing
+ * ones aside, then frequent tokens of English text are coded by fewer
+ * symbols, the most frequent by those whose codes in the key are the
+ * lightest. handy_decrypt() expands the plaintext, with '^' for spaces, if
+ * it is given the same flag. The update functions do not compress.
+ *
+ * With HANDY_ESCAPE, handy_encrypt() accepts any byte: lowercase letters are
+ * coded as uppercase ones, spaces as '^', and other bytes by sequences of
+ * symbols starting with '?', before compression. handy_decrypt() decodes
+ * them if it is given the same flag, and its output is then the plaintext
+ * bytes, hyphens added by the cipher removed. The update functions do not
+ * escape.
+ *
+ * Spaces are ignored from input. All functions return HANDY_OK or a negative
+ * error code, and handy_errmsg() describes the last error.
+ */
+
+#include <stdio.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* Flags for handy_init(). */
+#define HANDY_CORE   1  /* core cipher: no null characters */
+#define HANDY_TRACE  2  /* trace the process on standard output */
+#define HANDY_FRAMED 4  /* framed ciphertext, see handy_decrypt_range() */
+#define HANDY_MAC    8  /* authenticated ciphertext, not framed */
+#define HANDY_PACKED 16 /* packed binary ciphertext, not framed or MAC */
+#define HANDY_COMPRESS 32 /* compressed plaintext, not framed */
+#define HANDY_ESCAPE 64 /* escaped plaintext, not framed */
+
+/* Error codes. */
+#define HANDY_OK          0
+#define HANDY_EKEY       -1 /* invalid key */
+#define HANDY_ECODE      -2 /* plaintext character cannot be coded */
+#define HANDY_EINPUT     -3 /* invalid ciphertext character */
+#define HANDY_ESEQUENCE  -4 /* invalid ciphertext sequence */
+#define HANDY_ERANDOM    -5 /* cannot initialize random source */
+#define HANDY_EIO        -6 /* cannot read or write a stream */
+#define HANDY_EINTERNAL  -7 /* this should not happen! */
+#define HANDY_EMEMORY    -8 /* out of memory */
+#define HANDY_EFORMAT    -9 /* invalid or incompatible format */
+#define HANDY_EMAC      -10 /* ciphertext authentication failed */
+
+/* Default density of null and noise characters, in percent. */
+#define HANDY_DENSITY 50
+
+/* Output room needed to encrypt one character. */
+#define HANDY_OUTPUT_MIN 160
+
+struct handy;
+
+/* Allocate a cipher context. Return 0 if out of memory. */
+struct handy *handy_new(void);
+
+/* Free a cipher context. */
+void handy_free(struct handy *cipher);
+
+/* Initialize CIPHER with the 51 characters of KEY and FLAGS. Return
+ * HANDY_EFORMAT if FLAGS combine formats which exclude each other. */
+int handy_init(struct handy *cipher, const char *key, int flags);
+
+/* Same as handy_init(), but seed the random source with STATE and SEQUENCE
+ * instead of system entropy: encryption is then reproducible, for a given
+ * number of threads. Do not use it to encrypt real messages. */
+int handy_init_seeded(struct handy *cipher, const char *key, int flags,
+                      uint64_t state, uint64_t sequence);
+
+/* Return a message describing the last error of CIPHER. */
+const char *handy_errmsg(struct handy *cipher);
+
+/* Use THREADS threads in handy_encrypt() and handy_decrypt(), 1 by default.
+ * Framed ciphertext is encrypted on one thread, and decrypted on several
+ * only from a regular file. Call after handy_init(). */
+void handy_set_threads(struct handy *cipher, int threads);
+
+/* Salt the ciphertext of CIPHER with nulls and noises with a probability of
+ * DENSITY percent (0-100) each time one may be added, HANDY_DENSITY by
+ * default. Lower densities give shorter ciphertext, faster to write and to
+ * decrypt; decryption does not depend on it. HANDY_CORE is the same as a
+ * density of 0 for nulls only, and rejects them when decrypting. Call after
+ * handy_init(). */
+void handy_set_density(struct handy *cipher, int density);
+
+/* Prepare CIPHER for a new message, keeping its key and random source. */
+void handy_reset(struct handy *cipher);
+
+/* Allocate a copy of CIPHER, keyed and ready for a new message, without
+ * deriving its tables again. Its random source is seeded from the one of
+ * CIPHER. Return 0 if out of memory. */
+struct handy *handy_clone(struct handy *cipher);
+
+/* Encrypt a buffer into formatted ciphertext. */
+int handy_encrypt_update(struct handy *cipher, const char *in, size_t *inlen,
+                         char *out, size_t *outlen);
+int handy_encrypt_final(struct handy *cipher, const char *in, size_t *inlen,
+                        char *out, size_t *outlen);
+
+/* Decrypt a buffer of ciphertext. */
+int handy_decrypt_update(struct handy *cipher, const char *in, size_t *inlen,
+                         char *out, size_t *outlen);
+int handy_decrypt_final(struct handy *cipher, const char *in, size_t *inlen,
+                        char *out, size_t *outlen);
+
+/* Output to stream TO an encryption of stream FROM. Unless the ciphertext
+ * is framed, FROM is read ahead and TO written behind by two more threads
+ * past their first megabyte, while the calling one encrypts;
+ * handy_decrypt() does the same, unless the ciphertext is framed or
+ * packed. On an error, they return without waiting for the reader thread
+ * to finish a read of FROM: closing FROM then waits for it. */
+int handy_encrypt(struct handy *cipher, FILE *from, FILE *to);
+
+/* Output to stream TO a decryption of stream FROM. */
+int handy_decrypt(struct handy *cipher, FILE *from, FILE *to);
+
+/* Output to stream TO the characters [START;END[ of the decryption of
+ * stream FROM, which must be framed. Offsets count the characters output by
+ * handy_decrypt(), hyphens added by the cipher included. Framed ciphertext
+ * restarts every few thousand characters and ends with an index of its
+ * frames: if FROM is a regular file, only the frames of the range are
+ * decrypted, on several threads. */
+int handy_decrypt_range(struct handy *cipher, FILE *from, FILE *to,
+                        size_t start, size_t end);
+
+/* Generate a 51 characters KEY from a PASSWORD string, with a single hash.
+ * Prefer handy_keygen_kdf() for new messages. */
+void handy_keygen(const char *password, char *key);
+
+/* Parameters of a password-based key derivation, stored with a message. */
+#define HANDY_SALT_SIZE 16
+
+struct handy_kdf {
+    unsigned long iterations;   /* cost of the derivation */
+    unsigned char salt[HANDY_SALT_SIZE];
+};
+
+/* Initialize KDF with ITERATIONS and a random salt. */
+int handy_kdf_init(struct handy_kdf *kdf, unsigned long iterations);
+
+/* Same as handy_kdf_init(), but draw the salt from a random source seeded
+ * with STATE and SEQUENCE, as handy_init_seeded() does for the cipher. */
+void handy_kdf_init_seeded(struct handy_kdf *kdf, unsigned long iterations,
+                           uint64_t state, uint64_t sequence);
+
+/* Generate a 51 characters KEY from a PASSWORD string with PBKDF2-HMAC-SHA256
+ * and the parameters of KDF. Its cost grows with the number of iterations:
+ * derive a key once to process many messages. */
+void handy_keygen_kdf(const char *password, const struct handy_kdf *kdf,
+                      char *key);
+
+/* Same as handy_keygen_kdf() for each of the N parameters of KDF, into
+ * KEYS[i]. Derivations are run several at once: this is faster than N calls,
+ * especially when consecutive parameters have the same iterations. */
+void handy_keygen_kdf_multi(const char *password, const struct handy_kdf *kdf,
+                            size_t n, char (*keys)[51]);
+
+/* Write the parameters of KDF as a header line to stream TO, before the
+ * ciphertext. */
+int handy_write_kdf(FILE *to, const struct handy_kdf *kdf);
+
+/* Read a header line written by handy_write_kdf() from stream FROM into KDF.
+ * Return 1 if read, 0 if there is none, or HANDY_EFORMAT if it is invalid.
+ * handy_decrypt() skips this line. */
+int handy_read_kdf(FILE *from, struct handy_kdf *kdf);
+
+#endif /* HANDY_H */
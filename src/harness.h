@@ -0,0 +1,53 @@
+#ifndef HARNESS_H
+#define HARNESS_H
+
+/* Helpers shared by handy-check and handy-bench, included after the cipher
+ * source. HARNESS_NAME, the name of the program, prefixes its errors.
+ */
+
+#ifndef HARNESS_NAME
+#error "HARNESS_NAME must name the program"
+#endif
+
+/* Print a message and exit with a failure code. */
+static void
+die(const char *msg, const char *arg)
+{
+    fprintf(stderr, HARNESS_NAME ": %s -- %s\n", msg, arg);
+    exit(EXIT_FAILURE);
+}
+
+/* Check error code ERR of CIPHER. */
+static void
+check(struct handy *cipher, int err)
+{
+    if (err)
+        die("cipher error", handy_errmsg(cipher));
+}
+
+/* Return a temporary stream holding the LEN bytes of BUFFER. */
+static FILE *
+spill(const char *buffer, size_t len)
+{
+    FILE *file;
+
+    if (!(file = tmpfile()) || fwrite(buffer, 1, len, file) != len
+        || fflush(file))
+        die("cannot write temporary file", strerror(errno));
+    rewind(file);
+    return file;
+}
+
+/* Fill BUFFER with LEN characters drawn from ALPHABET. */
+static void
+generate(char *buffer, size_t len, const char *alphabet)
+{
+    struct pcgstate rng[1];
+    size_t i, n = strlen(alphabet);
+
+    pcg_seed(rng, 0x68616e6479ULL, 1);
+    for (i = 0; i < len; i++)
+        buffer[i] = alphabet[pcg_boundedrand(rng, (uint32_t) n)];
+}
+
+#endif /* HARNESS_H */
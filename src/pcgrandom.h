@@ -4,6 +4,10 @@
 /* PCG Random Number Generation
  * Adapted from http://www.pcg-random.org
  *
+ * The bit cache of struct pcgbits is filled by blocks from PCG_LANES streams
+ * advanced side by side, with AVX-512 or AVX2 instructions when available
+ * (chosen at run time), and with plain C code otherwise.
+ *
  * To get the implementation, define PCGRANDOM_IMPLEMENTATION.
  * Optionally define PCGRANDOM_API to control the API's visibility
  * and/or linkage (static, __attribute__, __declspec).
@@ -20,6 +24,23 @@ struct pcgstate {
     uint64_t inc;
 };
 
+/* Number of streams of a block, and of 32-bit numbers in a block. */
+#define PCG_LANES 8
+#define PCG_BLOCK 256
+
+/* A generator with a cache of random bits, for cheap small draws. */
+struct pcgbits {
+    struct pcgstate rng[1];             /* seeds the streams */
+    uint64_t state[PCG_LANES];          /* streams of the block */
+    uint64_t inc[PCG_LANES];
+    uint32_t block[PCG_BLOCK];          /* random numbers */
+    int next;                           /* index of the next unused number */
+    uint64_t word;  /* unused random bits */
+    int avail;      /* number of unused bits in WORD */
+    int simd;       /* instructions filling blocks: 0 for C, 1 for AVX2,
+                     * 2 for AVX-512 */
+};
+
 /* Initialize generator. */
 PCGRANDOM_API
 void pcg_seed(struct pcgstate *rng, uint64_t initstate, uint64_t initseq);
@@ -37,6 +58,21 @@ uint32_t pcg_rand(struct pcgstate *rng);
 PCGRANDOM_API
 uint32_t pcg_boundedrand(struct pcgstate *rng, uint32_t bound);
 
+/* Seed the streams of a generator from its RNG and empty its bit cache,
+ * after its RNG has been seeded. Blocks are then filled with the best
+ * instructions of the CPU. */
+PCGRANDOM_API
+void pcg_bitsinit(struct pcgbits *bits);
+
+/* Generate a uniformly distributed N-bit random number (0 <= N <= 32). */
+PCGRANDOM_API
+uint32_t pcg_getbits(struct pcgbits *bits, int n);
+
+/* Generate a uniformly distributed number r, where 0 <= r < bound,
+ * consuming cached bits for small bounds. */
+PCGRANDOM_API
+uint32_t pcg_smallrand(struct pcgbits *bits, uint32_t bound);
+
 /* Implementation. */
 #ifdef PCGRANDOM_IMPLEMENTATION
 
@@ -45,6 +81,206 @@ uint32_t pcg_boundedrand(struct pcgstate *rng, uint32_t bound);
 #include <unistd.h>
 #include <fcntl.h>
 
+#if defined(__GNUC__) && defined(__x86_64__)
+#define PCGRANDOM_X86
+#include <immintrin.h>
+#endif
+
+#define PCG_MULT 6364136223846793005ULL
+
+/* Return the best instructions of this CPU to fill blocks. */
+static int
+pcg_cpu(void)
+{
+#ifdef PCGRANDOM_X86
+    if (__builtin_cpu_supports("avx512f")
+        && __builtin_cpu_supports("avx512dq"))
+        return 2;
+    if (__builtin_cpu_supports("avx2"))
+        return 1;
+#endif
+    return 0;
+}
+
+/* Fill the block of BITS with plain C code: number I comes from stream
+ * I % PCG_LANES. */
+static void
+pcg_fill_c(struct pcgbits *bits)
+{
+    int i, k;
+    uint64_t old;
+    uint32_t xorshifted, rot;
+
+    for (i = 0; i < PCG_BLOCK; i += PCG_LANES)
+        for (k = 0; k < PCG_LANES; k++) {
+            old = bits->state[k];
+            bits->state[k] = old * PCG_MULT + bits->inc[k];
+            xorshifted = ((old >> 18u) ^ old) >> 27u;
+            rot = old >> 59u;
+            bits->block[i + k] = (xorshifted >> rot)
+                               | (xorshifted << ((-rot) & 31));
+        }
+}
+
+#ifdef PCGRANDOM_X86
+
+/* Streams are split into PCG_CHAINS interleaved chains by the SIMD
+ * versions. A chain steps with PCG_JUMP_MULT = PCG_MULT^PCG_CHAINS, and
+ * with the increments set by pcg_jump(). */
+#define PCG_CHAINS 4
+#define PCG_JUMP_MULT 0xfb4d3ae39272be11ULL
+
+/* Set JUMP to the increments of the chains of BITS:
+ * inc * (1 + PCG_MULT + ... + PCG_MULT^(PCG_CHAINS-1)). */
+static void
+pcg_jump(struct pcgbits *bits, uint64_t *jump)
+{
+    int i, k;
+    uint64_t sum, power;
+
+    for (sum = 0, power = 1, i = 0; i < PCG_CHAINS; i++) {
+        sum += power;
+        power *= PCG_MULT;
+    }
+    for (k = 0; k < PCG_LANES; k++)
+        jump[k] = bits->inc[k] * sum;
+}
+
+/* Return the 4 outputs of the 64-bit OLD states, in the even 32-bit
+ * elements. */
+__attribute__((target("avx2")))
+static __m256i
+pcg_output256(__m256i old)
+{
+    __m256i x, rot;
+
+    x = _mm256_srli_epi64(
+            _mm256_xor_si256(_mm256_srli_epi64(old, 18), old), 27);
+    rot = _mm256_srli_epi64(old, 59);
+    /* shifts by 32 give 0, so no mask is needed for ROT = 0 */
+    return _mm256_or_si256(_mm256_srlv_epi32(x, rot),
+            _mm256_sllv_epi32(x, _mm256_sub_epi32(_mm256_set1_epi32(32),
+                                                  rot)));
+}
+
+/* Return OLD * MULT + INC on 4 64-bit lanes: AVX2 has no 64-bit
+ * multiplication, it is made of 32-bit ones. */
+__attribute__((target("avx2")))
+static __m256i
+pcg_step256(__m256i old, __m256i mult, __m256i inc)
+{
+    __m256i cross;
+
+    cross = _mm256_add_epi64(
+            _mm256_mul_epu32(_mm256_srli_epi64(old, 32), mult),
+            _mm256_mul_epu32(old, _mm256_srli_epi64(mult, 32)));
+    return _mm256_add_epi64(
+            _mm256_add_epi64(_mm256_mul_epu32(old, mult),
+                             _mm256_slli_epi64(cross, 32)),
+            inc);
+}
+
+/* AVX2 version of pcg_fill_c(). Each stream runs PCG_CHAINS states apart
+ * to hide the latency of the multiplications: they jump PCG_CHAINS steps
+ * at once. */
+__attribute__((target("avx2")))
+static void
+pcg_fill_avx2(struct pcgbits *bits)
+{
+    int i, j;
+    uint64_t jump[PCG_LANES];
+    __m256i s[PCG_CHAINS][2], inc[2], incj[2], mult, multj, r0, r1;
+    const __m256i even = _mm256_setr_epi32(0, 2, 4, 6, 1, 3, 5, 7);
+
+    pcg_jump(bits, jump);
+    mult = _mm256_set1_epi64x((long long) PCG_MULT);
+    multj = _mm256_set1_epi64x((long long) PCG_JUMP_MULT);
+    for (j = 0; j < 2; j++) {
+        s[0][j] = _mm256_loadu_si256((const __m256i *) (bits->state + 4 * j));
+        inc[j] = _mm256_loadu_si256((const __m256i *) (bits->inc + 4 * j));
+        incj[j] = _mm256_loadu_si256((const __m256i *) (jump + 4 * j));
+    }
+    for (i = 1; i < PCG_CHAINS; i++)
+        for (j = 0; j < 2; j++)
+            s[i][j] = pcg_step256(s[i - 1][j], mult, inc[j]);
+    for (i = 0; i < PCG_BLOCK; i += PCG_CHAINS * PCG_LANES)
+        for (j = 0; j < PCG_CHAINS; j++) {
+            r0 = _mm256_permutevar8x32_epi32(pcg_output256(s[j][0]), even);
+            r1 = _mm256_permutevar8x32_epi32(pcg_output256(s[j][1]), even);
+            _mm256_storeu_si256((__m256i *) (bits->block + i + j * PCG_LANES),
+                                _mm256_permute2x128_si256(r0, r1, 0x20));
+            s[j][0] = pcg_step256(s[j][0], multj, incj[0]);
+            s[j][1] = pcg_step256(s[j][1], multj, incj[1]);
+        }
+    _mm256_storeu_si256((__m256i *) bits->state, s[0][0]);
+    _mm256_storeu_si256((__m256i *) (bits->state + 4), s[0][1]);
+}
+
+/* AVX-512 version of pcg_fill_avx2(), with a native 64-bit
+ * multiplication. */
+__attribute__((target("avx512f,avx512dq,avx2")))
+static void
+pcg_fill_avx512(struct pcgbits *bits)
+{
+    int i, j;
+    uint64_t jump[PCG_LANES];
+    __m512i s[PCG_CHAINS], inc, incj, mult, multj, x;
+    __m256i xorshifted, rot;
+
+    pcg_jump(bits, jump);
+    mult = _mm512_set1_epi64((long long) PCG_MULT);
+    multj = _mm512_set1_epi64((long long) PCG_JUMP_MULT);
+    s[0] = _mm512_loadu_si512(bits->state);
+    inc = _mm512_loadu_si512(bits->inc);
+    incj = _mm512_loadu_si512(jump);
+    for (i = 1; i < PCG_CHAINS; i++)
+        s[i] = _mm512_add_epi64(_mm512_mullo_epi64(s[i - 1], mult), inc);
+    for (i = 0; i < PCG_BLOCK; i += PCG_CHAINS * PCG_LANES)
+        for (j = 0; j < PCG_CHAINS; j++) {
+            x = _mm512_srli_epi64(
+                    _mm512_xor_si512(_mm512_srli_epi64(s[j], 18), s[j]), 27);
+            xorshifted = _mm512_cvtepi64_epi32(x);
+            rot = _mm512_cvtepi64_epi32(_mm512_srli_epi64(s[j], 59));
+            _mm256_storeu_si256(
+                    (__m256i *) (bits->block + i + j * PCG_LANES),
+                    _mm256_or_si256(_mm256_srlv_epi32(xorshifted, rot),
+                        _mm256_sllv_epi32(xorshifted,
+                            _mm256_sub_epi32(_mm256_set1_epi32(32), rot))));
+            s[j] = _mm512_add_epi64(_mm512_mullo_epi64(s[j], multj), incj);
+        }
+    _mm512_storeu_si512(bits->state, s[0]);
+}
+
+#endif /* PCGRANDOM_X86 */
+
+/* Fill the block of BITS and rewind it. */
+static void
+pcg_fill(struct pcgbits *bits)
+{
+    switch (bits->simd) {
+#ifdef PCGRANDOM_X86
+    case 2:
+        pcg_fill_avx512(bits);
+        break;
+    case 1:
+        pcg_fill_avx2(bits);
+        break;
+#endif
+    default:
+        pcg_fill_c(bits);
+    }
+    bits->next = 0;
+}
+
+/* Return the next number of the block of BITS. */
+static uint32_t
+pcg_next(struct pcgbits *bits)
+{
+    if (bits->next == PCG_BLOCK)
+        pcg_fill(bits);
+    return bits->block[bits->next++];
+}
+
 PCGRANDOM_API
 void
 pcg_seed(struct pcgstate *rng, uint64_t initstate, uint64_t initseq)
@@ -80,7 +316,7 @@ pcg_rand(struct pcgstate *rng)
     uint32_t xorshifted, rot;
 
     oldstate = rng->state;
-    rng->state = oldstate * 6364136223846793005ULL + rng->inc;
+    rng->state = oldstate * PCG_MULT + rng->inc;
     xorshifted = ((oldstate >> 18u) ^ oldstate) >> 27u;
     rot = oldstate >> 59u;
     return (xorshifted >> rot) | (xorshifted << ((-rot) & 31));
@@ -100,5 +336,78 @@ pcg_boundedrand(struct pcgstate *rng, uint32_t bound)
     }
 }
 
+PCGRANDOM_API
+void
+pcg_bitsinit(struct pcgbits *bits)
+{
+    int k;
+    uint64_t state, sequence;
+    struct pcgstate lane[1];
+
+    for (k = 0; k < PCG_LANES; k++) {
+        state = (uint64_t) pcg_rand(bits->rng) << 32;
+        state |= pcg_rand(bits->rng);
+        sequence = (uint64_t) pcg_rand(bits->rng) << 32;
+        sequence |= pcg_rand(bits->rng);
+        pcg_seed(lane, state, sequence);
+        bits->state[k] = lane->state;
+        bits->inc[k] = lane->inc;
+    }
+    bits->next = PCG_BLOCK; /* filled on first use */
+    bits->word = 0;
+    bits->avail = 0;
+    bits->simd = pcg_cpu();
+}
+
+PCGRANDOM_API
+uint32_t
+pcg_getbits(struct pcgbits *bits, int n)
+{
+    uint32_t r;
+
+    if (n >= 32)
+        return pcg_next(bits);
+    if (bits->avail < n) {
+        bits->word = (uint64_t) pcg_next(bits) << 32;
+        bits->word |= pcg_next(bits);
+        bits->avail = 64;
+    }
+    r = (uint32_t) bits->word & (((uint32_t) 1 << n) - 1);
+    bits->word >>= n;
+    bits->avail -= n;
+    return r;
+}
+
+PCGRANDOM_API
+uint32_t
+pcg_smallrand(struct pcgbits *bits, uint32_t bound)
+{
+    int n;
+    uint32_t threshold;
+    uint64_t m;
+
+    if (!(bound & (bound - 1))) { /* power of 2: take log2(bound) bits */
+        for (n = 0; bound > 1; n++)
+            bound >>= 1;
+        return pcg_getbits(bits, n);
+    }
+
+    /* Multiply-shift with rejection, see 'Fast Random Integer Generation
+     * in an Interval' by Daniel Lemire. Small bounds only need 16 bits. */
+    if (bound < 256) {
+        n = 16;
+        threshold = 65536 % bound;
+    }
+    else {
+        n = 32;
+        threshold = -bound % bound;
+    }
+    for (;;) {
+        m = (uint64_t) pcg_getbits(bits, n) * bound;
+        if ((m & (((uint64_t) 1 << n) - 1)) >= threshold)
+            return (uint32_t) (m >> n);
+    }
+}
+
 #endif /* PCGRANDOM_IMPLEMENTATION */
 #endif /* PCGRANDOM_H */
@@ -3,7 +3,9 @@
 
 /* SHA-256 hashing algorithm.
  * Adapted from code by Brad Conte.
- * This implementation uses little endian byte order.
+ * This implementation uses little endian byte order. Blocks are hashed with
+ * the x86 SHA extensions when available, and several PBKDF2 derivations are
+ * run at once with AVX2 (both chosen at run time), with plain C otherwise.
  *
  * To get the implementation, define SHA256_IMPLEMENTATION.
  * Optionally define SHA256_API to control the API's visibility
@@ -19,6 +21,9 @@
 
 #define SHA256_BLOCK_SIZE 32
 
+/* Number of derivations run at once by sha256_pbkdf2_multi(). */
+#define SHA256_LANES 8
+
 typedef struct {
     uint8_t data[64];
     uint32_t datalen;
@@ -35,6 +40,22 @@ void sha256_update(SHA256_CTX *ctx, const uint8_t data[], size_t len);
 SHA256_API
 void sha256_final(SHA256_CTX *ctx, uint8_t hash[]);
 
+/* PBKDF2-HMAC-SHA256 (RFC 8018) of PASSWORD and SALT with ITERATIONS,
+ * into OUT of OUTLEN bytes. */
+SHA256_API
+void sha256_pbkdf2(const uint8_t password[], size_t passlen,
+                   const uint8_t salt[], size_t saltlen,
+                   unsigned long iterations, uint8_t out[], size_t outlen);
+
+/* Same as sha256_pbkdf2() for N (at most SHA256_LANES) independent passwords
+ * and salts, with the same ITERATIONS, into the SHA256_BLOCK_SIZE bytes of
+ * each OUT[i]. */
+SHA256_API
+void sha256_pbkdf2_multi(int n, const uint8_t *password[],
+                         const size_t passlen[], const uint8_t *salt[],
+                         const size_t saltlen[], unsigned long iterations,
+                         uint8_t *out[]);
+
 #ifdef SHA256_IMPLEMENTATION
 
 #include <stdlib.h>
@@ -64,47 +85,255 @@ static const uint32_t k[64] = {
     0x90befffa,0xa4506ceb,0xbef9a3f7,0xc67178f2
 };
 
+/* Hash N blocks of DATA into STATE. */
 static void
-sha256_transform(SHA256_CTX *ctx, const uint8_t data[])
+sha256_blocks_c(uint32_t state[8], const uint8_t data[], size_t n)
 {
     uint32_t a, b, c, d, e, f, g, h, i, j, t1, t2, m[64];
 
-    for (i = 0, j = 0; i < 16; ++i, j += 4)
-        m[i] = (data[j] << 24) | (data[j + 1] << 16) |
-            (data[j + 2] << 8) | (data[j + 3]);
-    for ( ; i < 64; ++i)
-        m[i] = SIG1(m[i - 2]) + m[i - 7] + SIG0(m[i - 15]) + m[i - 16];
-
-    a = ctx->state[0];
-    b = ctx->state[1];
-    c = ctx->state[2];
-    d = ctx->state[3];
-    e = ctx->state[4];
-    f = ctx->state[5];
-    g = ctx->state[6];
-    h = ctx->state[7];
-
-    for (i = 0; i < 64; ++i) {
-        t1 = h + EP1(e) + CH(e,f,g) + k[i] + m[i];
-        t2 = EP0(a) + MAJ(a,b,c);
-        h = g;
-        g = f;
-        f = e;
-        e = d + t1;
-        d = c;
-        c = b;
-        b = a;
-        a = t1 + t2;
+    for (; n; n--, data += 64) {
+        for (i = 0, j = 0; i < 16; ++i, j += 4)
+            m[i] = ((uint32_t) data[j] << 24) | (data[j + 1] << 16) |
+                (data[j + 2] << 8) | (data[j + 3]);
+        for ( ; i < 64; ++i)
+            m[i] = SIG1(m[i - 2]) + m[i - 7] + SIG0(m[i - 15]) + m[i - 16];
+
+        a = state[0];
+        b = state[1];
+        c = state[2];
+        d = state[3];
+        e = state[4];
+        f = state[5];
+        g = state[6];
+        h = state[7];
+
+        for (i = 0; i < 64; ++i) {
+            t1 = h + EP1(e) + CH(e,f,g) + k[i] + m[i];
+            t2 = EP0(a) + MAJ(a,b,c);
+            h = g;
+            g = f;
+            f = e;
+            e = d + t1;
+            d = c;
+            c = b;
+            b = a;
+            a = t1 + t2;
+        }
+
+        state[0] += a;
+        state[1] += b;
+        state[2] += c;
+        state[3] += d;
+        state[4] += e;
+        state[5] += f;
+        state[6] += g;
+        state[7] += h;
     }
+}
+
+/* Instruction sets found at run time, -1 until checked. sha256_cpu() sets
+ * them on first use: a program hashing on several threads must call it
+ * once before, e.g. with pthread_once(). */
+#define SHA256_SHANI 1
+#define SHA256_AVX2  2
+
+static int sha256_simd = -1;
+
+#if defined(__GNUC__) && defined(__x86_64__)
+#define SHA256_X86
+#include <immintrin.h>
+#include <cpuid.h>
+
+/* SHA extensions version of sha256_blocks_c(). The state is kept as ABEF
+ * and CDGH words, and 4 message words are scheduled at a time, see 'Intel SHA
+ * Extensions' by Sean Gulley et al. */
+__attribute__((target("sha,sse4.1")))
+static void
+sha256_blocks_shani(uint32_t state[8], const uint8_t data[], size_t n)
+{
+    __m128i s0, s1, save0, save1, t, m[4];
+    const __m128i swap = _mm_set_epi64x(0x0c0d0e0f08090a0bLL,
+                                        0x0405060700010203LL);
+    int i;
+
+    t = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i *) state), 0xb1);
+    s1 = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i *) (state + 4)),
+                           0x1b);
+    s0 = _mm_alignr_epi8(t, s1, 8);        /* ABEF */
+    s1 = _mm_blend_epi16(s1, t, 0xf0);     /* CDGH */
+
+    for (; n; n--, data += 64) {
+        save0 = s0;
+        save1 = s1;
+        for (i = 0; i < 4; i++)
+            m[i] = _mm_shuffle_epi8(
+                    _mm_loadu_si128((const __m128i *) (data + 16 * i)), swap);
+        for (i = 0; i < 16; i++) {
+            t = _mm_add_epi32(m[i & 3],
+                    _mm_loadu_si128((const __m128i *) (k + 4 * i)));
+            s1 = _mm_sha256rnds2_epu32(s1, s0, t);
+            if (i < 12) /* words 4i+16 to 4i+19 */
+                m[i & 3] = _mm_sha256msg2_epu32(
+                        _mm_add_epi32(
+                            _mm_sha256msg1_epu32(m[i & 3], m[(i + 1) & 3]),
+                            _mm_alignr_epi8(m[(i + 3) & 3], m[(i + 2) & 3],
+                                            4)),
+                        m[(i + 3) & 3]);
+            s0 = _mm_sha256rnds2_epu32(s0, s1, _mm_shuffle_epi32(t, 0x0e));
+        }
+        s0 = _mm_add_epi32(s0, save0);
+        s1 = _mm_add_epi32(s1, save1);
+    }
+
+    t = _mm_shuffle_epi32(s0, 0x1b);       /* FEBA */
+    s1 = _mm_shuffle_epi32(s1, 0xb1);      /* DCHG */
+    _mm_storeu_si128((__m128i *) state, _mm_blend_epi16(t, s1, 0xf0));
+    _mm_storeu_si128((__m128i *) (state + 4), _mm_alignr_epi8(s1, t, 8));
+}
+
+#define SHA256_ROR8(x,n) _mm256_or_si256(_mm256_srli_epi32(x, n), \
+                                         _mm256_slli_epi32(x, 32 - (n)))
+
+/* Hash one block of message words M into STATE, for 8 independent messages
+ * (one per 32-bit lane). */
+__attribute__((target("avx2")))
+static void
+sha256_compress8(__m256i state[8], const __m256i m[16])
+{
+    __m256i w[64], s[8], t1, t2;
+    int i;
+
+    for (i = 0; i < 16; i++)
+        w[i] = m[i];
+    for (; i < 64; i++) {
+        t1 = _mm256_xor_si256(
+                _mm256_xor_si256(SHA256_ROR8(w[i - 2], 17),
+                                 SHA256_ROR8(w[i - 2], 19)),
+                _mm256_srli_epi32(w[i - 2], 10));
+        t2 = _mm256_xor_si256(
+                _mm256_xor_si256(SHA256_ROR8(w[i - 15], 7),
+                                 SHA256_ROR8(w[i - 15], 18)),
+                _mm256_srli_epi32(w[i - 15], 3));
+        w[i] = _mm256_add_epi32(_mm256_add_epi32(t1, w[i - 7]),
+                                _mm256_add_epi32(t2, w[i - 16]));
+    }
+
+    for (i = 0; i < 8; i++)
+        s[i] = state[i];
+    for (i = 0; i < 64; i++) {
+        /* t1 = h + EP1(e) + CH(e,f,g) + k[i] + w[i] */
+        t1 = _mm256_xor_si256(
+                _mm256_xor_si256(SHA256_ROR8(s[4], 6), SHA256_ROR8(s[4], 11)),
+                SHA256_ROR8(s[4], 25));
+        t2 = _mm256_xor_si256(_mm256_and_si256(s[4], s[5]),
+                              _mm256_andnot_si256(s[4], s[6]));
+        t1 = _mm256_add_epi32(_mm256_add_epi32(s[7], t1),
+                _mm256_add_epi32(t2, _mm256_add_epi32(w[i],
+                        _mm256_set1_epi32((int) k[i]))));
+        /* t2 = EP0(a) + MAJ(a,b,c) */
+        t2 = _mm256_add_epi32(
+                _mm256_xor_si256(
+                    _mm256_xor_si256(SHA256_ROR8(s[0], 2),
+                                     SHA256_ROR8(s[0], 13)),
+                    SHA256_ROR8(s[0], 22)),
+                _mm256_or_si256(_mm256_and_si256(s[0], s[1]),
+                    _mm256_and_si256(s[2], _mm256_or_si256(s[0], s[1]))));
+        s[7] = s[6];
+        s[6] = s[5];
+        s[5] = s[4];
+        s[4] = _mm256_add_epi32(s[3], t1);
+        s[3] = s[2];
+        s[2] = s[1];
+        s[1] = s[0];
+        s[0] = _mm256_add_epi32(t1, t2);
+    }
+    for (i = 0; i < 8; i++)
+        state[i] = _mm256_add_epi32(state[i], s[i]);
+}
+
+/* Run the PBKDF2 iterations 2 to ITERATIONS of 8 derivations with the
+ * keyed HMAC states INNER and OUTER: U holds the words of the first HMAC of
+ * each derivation, and is replaced with their result. */
+__attribute__((target("avx2")))
+static void
+sha256_pbkdf2_avx2(uint32_t inner[][8], uint32_t outer[][8],
+                   uint32_t u[][8], unsigned long iterations)
+{
+    __m256i si[8], so[8], s[8], m[16], t[8];
+    uint32_t words[8][8];
+    unsigned long n;
+    int i;
+
+    for (i = 0; i < 8; i++) {
+        si[i] = _mm256_set_epi32(inner[7][i], inner[6][i], inner[5][i],
+                inner[4][i], inner[3][i], inner[2][i], inner[1][i],
+                inner[0][i]);
+        so[i] = _mm256_set_epi32(outer[7][i], outer[6][i], outer[5][i],
+                outer[4][i], outer[3][i], outer[2][i], outer[1][i],
+                outer[0][i]);
+        t[i] = _mm256_set_epi32(u[7][i], u[6][i], u[5][i], u[4][i],
+                u[3][i], u[2][i], u[1][i], u[0][i]);
+        m[i] = t[i];
+    }
+    /* Padding of a 32 bytes message after a 64 bytes key block */
+    m[8] = _mm256_set1_epi32((int) 0x80000000);
+    for (i = 9; i < 15; i++)
+        m[i] = _mm256_setzero_si256();
+    m[15] = _mm256_set1_epi32(768);
+
+    for (n = 1; n < iterations; n++) {
+        for (i = 0; i < 8; i++)
+            s[i] = si[i];
+        sha256_compress8(s, m);
+        for (i = 0; i < 8; i++) {
+            m[i] = s[i];
+            s[i] = so[i];
+        }
+        sha256_compress8(s, m);
+        for (i = 0; i < 8; i++) {
+            m[i] = s[i];
+            t[i] = _mm256_xor_si256(t[i], s[i]);
+        }
+    }
+
+    for (i = 0; i < 8; i++)
+        _mm256_storeu_si256((__m256i *) words[i], t[i]);
+    for (i = 0; i < 64; i++)
+        u[i >> 3][i & 7] = words[i & 7][i >> 3];
+}
+
+#endif /* SHA256_X86 */
+
+/* Find the instruction sets of the processor. */
+static void
+sha256_cpu(void)
+{
+    int simd = 0;
+#ifdef SHA256_X86
+    unsigned a, b, c, d;
+
+    if (__get_cpuid_count(7, 0, &a, &b, &c, &d) && (b >> 29 & 1)
+        && __builtin_cpu_supports("sse4.1"))
+        simd |= SHA256_SHANI;
+    if (__builtin_cpu_supports("avx2"))
+        simd |= SHA256_AVX2;
+#endif
+    sha256_simd = simd;
+}
 
-    ctx->state[0] += a;
-    ctx->state[1] += b;
-    ctx->state[2] += c;
-    ctx->state[3] += d;
-    ctx->state[4] += e;
-    ctx->state[5] += f;
-    ctx->state[6] += g;
-    ctx->state[7] += h;
+/* Hash N blocks of DATA into STATE. */
+static void
+sha256_blocks(uint32_t state[8], const uint8_t data[], size_t n)
+{
+    if (sha256_simd < 0)
+        sha256_cpu();
+#ifdef SHA256_X86
+    if (sha256_simd & SHA256_SHANI) {
+        sha256_blocks_shani(state, data, n);
+        return;
+    }
+#endif
+    sha256_blocks_c(state, data, n);
 }
 
 SHA256_API
@@ -127,17 +356,29 @@ SHA256_API
 void
 sha256_update(SHA256_CTX *ctx, const uint8_t data[], size_t len)
 {
-    uint32_t i;
+    size_t n;
 
-    for (i = 0; i < len; ++i) {
-        ctx->data[ctx->datalen] = data[i];
-        ctx->datalen++;
-        if (ctx->datalen == 64) {
-            sha256_transform(ctx, ctx->data);
-            ctx->bitlen += 512;
-            ctx->datalen = 0;
-        }
+    /* Complete the buffered block, then hash whole blocks from DATA */
+    if (ctx->datalen) {
+        n = 64 - ctx->datalen < len ? 64 - ctx->datalen : len;
+        memcpy(ctx->data + ctx->datalen, data, n);
+        ctx->datalen += n;
+        data += n;
+        len -= n;
+        if (ctx->datalen < 64)
+            return;
+        sha256_blocks(ctx->state, ctx->data, 1);
+        ctx->bitlen += 512;
+        ctx->datalen = 0;
+    }
+    if ((n = len / 64)) {
+        sha256_blocks(ctx->state, data, n);
+        ctx->bitlen += 512 * (uint64_t) n;
+        data += 64 * n;
+        len -= 64 * n;
     }
+    memcpy(ctx->data, data, len);
+    ctx->datalen = len;
 }
 
 SHA256_API
@@ -158,7 +399,7 @@ sha256_final(SHA256_CTX *ctx, uint8_t hash[])
         ctx->data[i++] = 0x80;
         while (i < 64)
             ctx->data[i++] = 0x00;
-        sha256_transform(ctx, ctx->data);
+        sha256_blocks(ctx->state, ctx->data, 1);
         memset(ctx->data, 0, 56);
     }
 
@@ -172,7 +413,7 @@ sha256_final(SHA256_CTX *ctx, uint8_t hash[])
     ctx->data[58] = ctx->bitlen >> 40;
     ctx->data[57] = ctx->bitlen >> 48;
     ctx->data[56] = ctx->bitlen >> 56;
-    sha256_transform(ctx, ctx->data);
+    sha256_blocks(ctx->state, ctx->data, 1);
 
     /* Since this implementation uses little endian byte ordering and SHA uses
      * big endian, reverse all the bytes when copying the final state to the
@@ -189,5 +430,164 @@ sha256_final(SHA256_CTX *ctx, uint8_t hash[])
     }
 }
 
+/* Initialize the inner and outer contexts of HMAC with KEY. */
+static void
+sha256_hmac_init(SHA256_CTX *inner, SHA256_CTX *outer,
+                 const uint8_t key[], size_t keylen)
+{
+    uint8_t pad[64];
+    SHA256_CTX ctx;
+    int i;
+
+    memset(pad, 0, sizeof(pad));
+    if (keylen > sizeof(pad)) {
+        sha256_init(&ctx);
+        sha256_update(&ctx, key, keylen);
+        sha256_final(&ctx, pad);
+    }
+    else
+        memcpy(pad, key, keylen);
+
+    for (i = 0; i < 64; i++)
+        pad[i] ^= 0x36;
+    sha256_init(inner);
+    sha256_update(inner, pad, 64);
+    for (i = 0; i < 64; i++)
+        pad[i] ^= 0x36 ^ 0x5c;
+    sha256_init(outer);
+    sha256_update(outer, pad, 64);
+}
+
+/* Finish HMAC of contexts INNER and OUTER into MAC. */
+static void
+sha256_hmac_final(SHA256_CTX *inner, SHA256_CTX *outer, uint8_t mac[])
+{
+    uint8_t hash[SHA256_BLOCK_SIZE];
+
+    sha256_final(inner, hash);
+    sha256_update(outer, hash, sizeof(hash));
+    sha256_final(outer, mac);
+}
+
+/* Store the words of STATE into HASH, big endian. */
+static void
+sha256_store(const uint32_t state[8], uint8_t hash[])
+{
+    int i;
+
+    for (i = 0; i < 32; i++)
+        hash[i] = state[i >> 2] >> (24 - 8 * (i & 3));
+}
+
+/* Compute the first HMAC of a PBKDF2 derivation for BLOCK (counted from 1):
+ * set the keyed states INNER and OUTER of PASSWORD, and the words of the
+ * HMAC of SALT and BLOCK into U. */
+static void
+sha256_pbkdf2_first(const uint8_t password[], size_t passlen,
+                    const uint8_t salt[], size_t saltlen, uint32_t block,
+                    uint32_t inner[8], uint32_t outer[8], uint32_t u[8])
+{
+    SHA256_CTX ictx, octx;
+    uint8_t count[4], hash[SHA256_BLOCK_SIZE];
+    int i;
+
+    sha256_hmac_init(&ictx, &octx, password, passlen);
+    memcpy(inner, ictx.state, sizeof(ictx.state));
+    memcpy(outer, octx.state, sizeof(octx.state));
+    count[0] = block >> 24;
+    count[1] = block >> 16;
+    count[2] = block >> 8;
+    count[3] = block;
+    sha256_update(&ictx, salt, saltlen);
+    sha256_update(&ictx, count, 4);
+    sha256_hmac_final(&ictx, &octx, hash);
+    for (i = 0; i < 8; i++)
+        u[i] = (uint32_t) hash[4 * i] << 24 | hash[4 * i + 1] << 16
+             | hash[4 * i + 2] << 8 | hash[4 * i + 3];
+}
+
+/* Run the PBKDF2 iterations 2 to ITERATIONS of one derivation with the keyed
+ * states INNER and OUTER: U holds the words of the first HMAC, and is
+ * replaced with the result. The HMAC of a 32 bytes message is hashed as a
+ * single padded block, without going through contexts. */
+static void
+sha256_pbkdf2_iterate(const uint32_t inner[8], const uint32_t outer[8],
+                      uint32_t u[8], unsigned long iterations)
+{
+    uint32_t s[8], t[8];
+    uint8_t block[64];
+    unsigned long n;
+    int i;
+
+    memset(block, 0, sizeof(block));
+    block[32] = 0x80;
+    block[62] = 768 >> 8; /* bits of key block and message */
+    sha256_store(u, block);
+    memcpy(t, u, sizeof(t));
+    for (n = 1; n < iterations; n++) {
+        memcpy(s, inner, sizeof(s));
+        sha256_blocks(s, block, 1);
+        sha256_store(s, block);
+        memcpy(s, outer, sizeof(s));
+        sha256_blocks(s, block, 1);
+        sha256_store(s, block);
+        for (i = 0; i < 8; i++)
+            t[i] ^= s[i];
+    }
+    memcpy(u, t, sizeof(t));
+}
+
+SHA256_API
+void
+sha256_pbkdf2(const uint8_t password[], size_t passlen,
+              const uint8_t salt[], size_t saltlen,
+              unsigned long iterations, uint8_t out[], size_t outlen)
+{
+    uint32_t inner[8], outer[8], u[8], block;
+    uint8_t hash[SHA256_BLOCK_SIZE];
+    size_t len;
+
+    for (block = 1; outlen; block++) {
+        sha256_pbkdf2_first(password, passlen, salt, saltlen, block,
+                            inner, outer, u);
+        sha256_pbkdf2_iterate(inner, outer, u, iterations);
+        sha256_store(u, hash);
+        len = outlen < sizeof(hash) ? outlen : sizeof(hash);
+        memcpy(out, hash, len);
+        out += len;
+        outlen -= len;
+    }
+}
+
+SHA256_API
+void
+sha256_pbkdf2_multi(int n, const uint8_t *password[], const size_t passlen[],
+                    const uint8_t *salt[], const size_t saltlen[],
+                    unsigned long iterations, uint8_t *out[])
+{
+    uint32_t inner[SHA256_LANES][8], outer[SHA256_LANES][8];
+    uint32_t u[SHA256_LANES][8];
+    int i;
+
+    for (i = 0; i < SHA256_LANES; i++) /* unused lanes repeat the first */
+        sha256_pbkdf2_first(password[i < n ? i : 0], passlen[i < n ? i : 0],
+                            salt[i < n ? i : 0], saltlen[i < n ? i : 0], 1,
+                            inner[i], outer[i], u[i]);
+    if (sha256_simd < 0)
+        sha256_cpu();
+#ifdef SHA256_X86
+    /* 8 lanes of AVX2 take about the time of 6 or 7 derivations with the
+     * SHA extensions, and of 2 in plain C */
+    if ((sha256_simd & SHA256_AVX2)
+        && n > (sha256_simd & SHA256_SHANI ? 6 : 1))
+        sha256_pbkdf2_avx2(inner, outer, u, iterations);
+    else
+#endif
+    for (i = 0; i < n; i++)
+        sha256_pbkdf2_iterate(inner[i], outer[i], u[i], iterations);
+    for (i = 0; i < n; i++)
+        sha256_store(u[i], out[i]);
+}
+
 #endif /* SHA256_IMPLEMENTATION */
 #endif /* SHA256_H */